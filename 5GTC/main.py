@@ -14,11 +14,21 @@ import logging
 import yaml
 import os
 import signal
+import errno
+import subprocess
+import time
 
 from pkg import PerformanceLogger, WebUI
 from pkg.convert import *
 
 DEFAULT_BUFFER_SIZE = 4096
+DEFAULT_FASTOPEN_QUEUE_LEN = 16
+
+# epoll events of the proxied sockets. They are edge-triggered: a socket
+# is only reported again once something new happens, so it has to be
+# read (or written) until EAGAIN.
+EPOLL_READ = select.EPOLLIN | select.EPOLLRDHUP | select.EPOLLET
+EPOLL_WRITE = select.EPOLLOUT | select.EPOLLET
 
 # Create logger
 logging.basicConfig()
@@ -54,20 +64,52 @@ class TCServer:
         self.sock = socket.socket(socket.AF_INET, socket.SOCK_STREAM, socket.IPPROTO_MPTCP)
         # Set socket reuse
         self.sock.setsockopt(socket.SOL_SOCKET, socket.SO_REUSEADDR, 1)
+        # Accept the Convert header in the SYN from clients using CONVERT_FASTOPEN
+        fastopen_queue_len = config["network"].get("fastopen_queue_len", DEFAULT_FASTOPEN_QUEUE_LEN)
+        if fastopen_queue_len:
+            self.sock.setsockopt(socket.SOL_TCP, socket.TCP_FASTOPEN, fastopen_queue_len)
+
+        # Replies that never change are built once
+        supported_tcp_ext = [TCPOPT_MPTCP]
+        if fastopen_queue_len:
+            supported_tcp_ext.append(TCPOPT_FASTOPEN)
+        self.convert_empty = build_convert()
+        self.convert_info_reply = build_convert(supported_tcp_ext=bytes(supported_tcp_ext))
+        # Scratch space of read_convert_message()
+        self.convert_buffer = bytearray(MSG_MAX_LEN)
+
         self.sock.bind((self.ip, self.port))
         self.sock.listen(200)
+        self.sock.setblocking(False)
+        # Spare file descriptor, given up to accept (and drop) a client
+        # when the process runs out of them: the edge-triggered listener
+        # is not reported again while connections are left queued
+        self.spare_fd = os.open(os.devnull, os.O_RDONLY)
 
         # Start WebUI
         self.webui = WebUI(config["webui"]["host"], config["webui"]["port"], log=self.log)
         self.webui.run()
 
-        # Maintain socket states
+        # Maintain socket states, keyed by file descriptor
         self.forward_map = {}
         self.perf_loggers = {}
 
-        # Input list
-        self.inputs = [self.sock]
+        # Sockets registered in the event loop
+        self.epoll = select.epoll()
+        self.epoll.register(self.sock.fileno(), select.EPOLLIN | select.EPOLLET)
+        self.sockets = {}
         self.track_client_sockets = {}
+        # Accepted client sockets whose Convert header has not arrived
+        # yet, with the parser of what arrived so far
+        self.pending_clients = {}
+        # Server sockets still connecting, with their client socket and
+        # the reply it gets once connected
+        self.connecting = {}
+        # Data a socket did not accept yet. While it is not empty, the
+        # other socket of the pair is not read.
+        self.send_buffers = {}
+        # Sockets to close once their queued data is sent
+        self.closing = set()
 
         # Start the server
         self.run_nonblocking()
@@ -78,50 +120,159 @@ class TCServer:
     def run_nonblocking(self):
         """
         Run the server in a non-blocking manner
-        Each operation is handled in a separate thread
+        A single edge-triggered epoll loop handles every connection
         """
         logger.info("Server listening on {}".format(self.sock.getsockname()))
+        listen_fd = self.sock.fileno()
         while True:
-            # Wait for input
-            readable, _, _ = select.select(self.inputs, [], [])
-            for s in readable:
-                if s is self.sock:
-                    # Accept a connection
-                    client_sock, addr = self.sock.accept()
-
-                    logger.debug("Accepted connection from {} with fd={}".format(addr, client_sock.fileno()))
-                    logger.debug(client_sock)
-
-                    success = self.handle_connection(client_sock)
-                    if not success:
-                        client_sock.close()
-                else:
+            # Wait for events
+            for fd, events in self.epoll.poll():
+                if fd == listen_fd:
+                    self.accept_clients()
+                    continue
+
+                sock = self.sockets.get(fd)
+                if sock is None:
+                    # Closed while handling an earlier event
+                    continue
+                if fd in self.connecting:
+                    self.handle_connected(sock)
+                    continue
+
+                if events & select.EPOLLOUT:
+                    self.flush(sock)
+                if fd in self.pending_clients:
+                    self.handle_connection(sock)
+                elif fd in self.forward_map:
                     # Read from the socket
-                    self.read_and_forward(s)
-            
+                    self.read_and_forward(sock)
+                # Else the client waits for its server socket to connect:
+                # what it sends is read once it has
+
+    def accept_clients(self):
+        """
+        Accept all the connections waiting on the listening socket
+        """
+        while True:
+            try:
+                client_sock, addr = self.sock.accept()
+            except BlockingIOError:
+                return
+            except OSError as e:
+                if e.errno == errno.ECONNABORTED:
+                    # The client left before it was accepted
+                    continue
+                if e.errno in (errno.EMFILE, errno.ENFILE) and self.spare_fd >= 0:
+                    # Out of file descriptors: drop the queued clients
+                    while self.drop_client():
+                        pass
+                else:
+                    logger.error("Error accepting connection: {}".format(e))
+                # Re-arm the listener for what could not be accepted
+                self.epoll.modify(self.sock.fileno(), select.EPOLLIN | select.EPOLLET)
+                return
+
+            logger.debug("Accepted connection from {} with fd={}".format(addr, client_sock.fileno()))
+            logger.debug(client_sock)
+
+            # Clients may keep idle connections open (e.g. a warm
+            # pool) and only send the Convert header later: wait
+            # for it without blocking the other connections.
+            client_sock.setblocking(False)
+            self.register(client_sock, EPOLL_READ)
+            self.pending_clients[client_sock.fileno()] = Parser()
+            # With TCP Fast Open the header came with the SYN
+            self.handle_connection(client_sock)
+
+    def drop_client(self):
+        """
+        Accept a client and close it right away, with the spare file
+        descriptor given up for it. Returns False once no client could
+        be accepted.
+        """
+        os.close(self.spare_fd)
+        try:
+            client_sock, addr = self.sock.accept()
+        except OSError:
+            return False
+        else:
+            client_sock.close()
+            logger.error("Out of file descriptors, dropped connection from {}".format(addr))
+            return True
+        finally:
+            try:
+                self.spare_fd = os.open(os.devnull, os.O_RDONLY)
+            except OSError:
+                self.spare_fd = -1
+
+    def register(self, sock, events):
+        """
+        Add the socket to the event loop
+        """
+        self.sockets[sock.fileno()] = sock
+        self.epoll.register(sock.fileno(), events)
+
+    def close_socket(self, sock):
+        """
+        Remove the socket from the event loop and close it
+        """
+        fd = sock.fileno()
+        if self.sockets.pop(fd, None) is not None:
+            self.epoll.unregister(fd)
+        self.pending_clients.pop(fd, None)
+        self.connecting.pop(fd, None)
+        self.send_buffers.pop(fd, None)
+        self.closing.discard(fd)
+        self.track_client_sockets.pop(fd, None)
+        sock.close()
 
     def handle_connection(self, client_sock):
         """
         Handle a new connection from a client
-        Parses the Convert header and handles the TLVs
+        Parses the Convert header as it arrives and handles the TLVs once
+        it is complete. The client socket is closed on error.
         """
+        fd = client_sock.fileno()
         try:
             # Read the Convert header from the client (TCP Fast Open)
-            convert = read_convert_header(client_sock)
-            if convert is None:
-                logger.error("Error reading Convert header from client")
+            convert = None
+            while convert is None:
+                convert = read_convert_message(client_sock, self.pending_clients[fd],
+                                               self.convert_buffer)
+
+            del self.pending_clients[fd]
+
+            if convert.flags & ~(F_INFO | F_CONNECT):
+                logger.debug("Ignored TLVs: flags {:#x}".format(convert.flags))
+
+            if convert.flags & F_CONNECT:
+                # The client reads a single reply: the one to the
+                # Connect TLV answers the Info TLV too
+                self.handle_tlv_connect(convert, client_sock)
                 return
-            
-            # Go through the TLVs and handle them
-            for tlv in convert.tlvs:
-                if CONVERT_TLVS[tlv.type] == "connect":
-                    self.handle_tlv_connect(tlv, client_sock)
-                else:
-                    logger.debug("Handled TLV: {}".format(CONVERT_TLVS[tlv.type]))
-            return True
+            if convert.flags & F_INFO:
+                self.handle_tlv_info(client_sock)
+            if fd in self.send_buffers:
+                # Nothing to relay: close once the Info reply is sent
+                self.closing.add(fd)
+            else:
+                self.close_socket(client_sock)
+        except BlockingIOError:
+            # The rest of the header is still to come
+            return
         except Exception as e:
             logger.error("Error handling Convert Protocol header: {}".format(e))
-            return False
+            self.close_socket(client_sock)
+
+    def handle_tlv_info(self, client_sock):
+        """
+        Handle the Info TLV
+
+        This TLV is sent by the client to learn the TCP extensions the
+        server supports, which are announced in a Supported TCP
+        Extensions TLV.
+        """
+        self.send(client_sock, self.convert_info_reply)
 
     def handle_tlv_connect(self, tlv, client_sock):
         """
@@ -129,28 +280,52 @@ class TCServer:
 
         This TLV is sent by the client to the server to indicate that
         it wants to connect to a remote server. The server then
-        connects to the remote server and sends an empty Convert
-        header to the client to mimic the destination server sending
-        it.
+        connects to the remote server and sends a Convert header to
+        the client to mimic the destination server sending it. The
+        header is empty, unless it answers an Info TLV as well.
         """
-        # Create a new socket to the server
-        ipv4 = ipv6_to_ipv4(tlv.remote_addr)
-        server_sock = socket.socket(socket.AF_INET, socket.SOCK_STREAM, socket.IPPROTO_TCP)
-        try:
-            server_sock.connect((ipv4, tlv.remote_port))
-        except Exception as e:
-            logger.error("Error connecting to server: {}".format(e))
+        # Create a new socket to the server; IPv4 destinations come
+        # unmapped from the codec
+        family = socket.AF_INET6 if ":" in tlv.remote_addr else socket.AF_INET
+        server_sock = socket.socket(family, socket.SOCK_STREAM, socket.IPPROTO_TCP)
+        server_sock.setblocking(False)
+        err = server_sock.connect_ex((tlv.remote_addr, tlv.remote_port))
+        if err not in (0, errno.EINPROGRESS):
+            logger.error("Error connecting to server: {}".format(os.strerror(err)))
             # Close connection to client to indicate error
-            client_sock.close()
+            server_sock.close()
+            self.close_socket(client_sock)
             return
 
+        # Wait for the connection to complete without blocking the loop
+        self.register(server_sock, EPOLL_WRITE)
+        reply = self.convert_info_reply if tlv.flags & F_INFO else self.convert_empty
+        self.connecting[server_sock.fileno()] = (client_sock, reply)
 
-        # Send empty Convert header to client (to mimic destination server sending it)
-        client_sock.send(Convert().build())
+    def handle_connected(self, server_sock):
+        """
+        Start relaying between the client and the server once the
+        connection to the server completed
+        """
+        client_sock, reply = self.connecting.pop(server_sock.fileno())
+        err = server_sock.getsockopt(socket.SOL_SOCKET, socket.SO_ERROR)
+        if err:
+            logger.error("Error connecting to server: {}".format(os.strerror(err)))
+            # Close connection to client to indicate error
+            self.close_socket(server_sock)
+            self.close_socket(client_sock)
+            return
+        self.epoll.modify(server_sock.fileno(), EPOLL_READ)
+
+        # Send the Convert reply to client (to mimic destination server sending it)
+        try:
+            self.send(client_sock, reply)
+        except OSError as e:
+            logger.error(e)
+            self.close_socket(server_sock)
+            self.close_socket(client_sock)
+            return
 
-        # Add the server and client sockets to the input list
-        self.inputs.append(server_sock)
-        self.inputs.append(client_sock)
         self.track_client_sockets[client_sock.fileno()] = True
         self.track_client_sockets[server_sock.fileno()] = False
         
@@ -165,59 +340,121 @@ class TCServer:
             features=self.config["performance"]["tcp_subflow_info_features"],
         )
 
+        # What the client sent behind its Convert header while the server
+        # was connecting raised no event of its own
+        self.read_and_forward(client_sock)
+
+    def send(self, sock, data):
+        """
+        Send data to the socket, queueing what it does not accept yet
+        until it is writable again
+        """
+        fd = sock.fileno()
+        backlog = self.send_buffers.get(fd)
+        if backlog is not None:
+            backlog += data
+            return
+
+        try:
+            sent = sock.send(data)
+        except BlockingIOError:
+            sent = 0
+        if sent < len(data):
+            self.send_buffers[fd] = bytearray(data[sent:])
+            self.epoll.modify(fd, EPOLL_READ | EPOLL_WRITE)
+
+    def flush(self, sock):
+        """
+        Send the data queued for the socket. Once all of it is sent,
+        resume reading from the other socket of the pair, or close the
+        socket if it was waiting for that.
+        """
+        fd = sock.fileno()
+        backlog = self.send_buffers.get(fd)
+        if backlog is None:
+            return
+        while backlog:
+            try:
+                sent = sock.send(backlog)
+            except BlockingIOError:
+                return
+            except OSError as e:
+                logger.error(e)
+                self.cleanup_socket(sock)
+                return
+            del backlog[:sent]
+
+        del self.send_buffers[fd]
+        if fd in self.closing:
+            self.close_socket(sock)
+            return
+        self.epoll.modify(fd, EPOLL_READ)
+        other = self.forward_map.get(fd)
+        if other is not None:
+            self.read_and_forward(other)
+
     def read_and_forward(self, sock):
         """
         Read from the socket and forward the data to its corresponding
-        socket. If the socket is closed, close the other socket and
-        remove them from the input list and forward map. 
+        socket, until there is nothing left to read or the other socket
+        does not accept more. If the socket is closed, close the other
+        socket and remove them from the event loop and forward map.
+        As the socket is not read while the other socket has data
+        queued, nothing is lost when closing it.
         """
         cfd, sfd = sock, self.forward_map[sock.fileno()]
-        if sfd.fileno() == -1 or cfd.fileno() == -1:
-            # Close both sockets
-            logger.debug("Socket pair {} already closed, terminating proxy connection between them.".format(sock.fileno()))
-            self.cleanup_socket_pair(cfd, sfd)
-        try:
-            data = sock.recv(self.read_buffer_size)
-        except Exception as e:
-            logger.error(e)
-            self.cleanup_socket_pair(cfd, sfd)
-            return
-        if data:
-            # Forward data to the other socket
-            self.forward_map[sock.fileno()].send(data)
+        while sfd.fileno() not in self.send_buffers:
+            try:
+                data = sock.recv(self.read_buffer_size)
+                if data:
+                    # Forward data to the other socket
+                    self.send(sfd, data)
+            except BlockingIOError:
+                return
+            except Exception as e:
+                logger.error(e)
+                self.cleanup_socket_pair(cfd, sfd)
+                return
+            if not data:
+                self.cleanup_socket_pair(cfd, sfd)
+                return
+
+    def cleanup_socket(self, sock):
+        """
+        Close the socket and the other socket of its pair, if any
+        """
+        other = self.forward_map.get(sock.fileno())
+        if other is not None:
+            self.cleanup_socket_pair(sock, other)
         else:
-            self.cleanup_socket_pair(cfd, sfd)
+            self.close_socket(sock)
 
     def cleanup_socket_pair(self, cfd, sfd):
         """
-        Close both sockets and remove them from the input list and
-        forward map. 
+        Close both sockets and remove them from the event loop and
+        forward map.
         """
         logger.debug("Closing socket pair (%d, %d)" % (cfd.fileno(), sfd.fileno()))
-        # Remove the socket from the input list
-        self.inputs.remove(cfd)
-        # Remove the socket from the forward map
+        # Remove the sockets from the forward map
         del self.forward_map[cfd.fileno()]
-
-        # Close and remove the other socket
         del self.forward_map[sfd.fileno()]
-        self.inputs.remove(sfd)
 
         # Print RTT values
-        perf_logger = self.perf_loggers.get(cfd.fileno(), None) or self.perf_loggers.get(sfd.fileno(), None)
+        perf_logger = self.perf_loggers.pop(cfd.fileno(), None) or self.perf_loggers.pop(sfd.fileno(), None)
         if perf_logger:
             perf_logger.stop()
 
         # Close the sockets
-        cfd.close()
-        sfd.close()
+        self.close_socket(cfd)
+        self.close_socket(sfd)
             
     def cleanup(self):
         """
         Tear down the server
         """
-        for s in self.inputs:
+        for s in list(self.sockets.values()):
             s.close()
+        self.epoll.close()
         # Destroy the performance logger DB
         if self.perf_loggers:
             [logger.stop for logger in self.perf_loggers.values()]
@@ -227,6 +464,8 @@ class TCServer:
             if os.path.exists("performance_log.db-journal"):
                 os.remove("performance_log.db-journal")
         self.sock.close()
+        if self.spare_fd >= 0:
+            os.close(self.spare_fd)
 
     def kill_existing_process_on_port(self, port):
         """
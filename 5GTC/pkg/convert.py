@@ -1,6 +1,10 @@
-from scapy.all import *
+import convert_codec
+from convert_codec import (Parser, Message, HDR_LEN, MSG_MAX_LEN,
+                           PARSE_ERROR, PARSE_MORE, PARSE_DONE,
+                           F_INFO, F_CONNECT, F_EXTENDED_TCP_HDR,
+                           F_SUPPORTED_TCP_EXT, F_COOKIE, F_ERROR)
 
-CONVERT_HEADER_LENGTH = 4
+CONVERT_HEADER_LENGTH = HDR_LEN
 
 CONVERT_TLVS = {
     0x1: 'info',
@@ -11,78 +15,40 @@ CONVERT_TLVS = {
     0x1e: 'error',
 }
 
-
-class _ConvertTLV_HDR(Packet):
-    fields_desc = [ByteEnumField(
-        "type", 0, CONVERT_TLVS), ByteField("length", 1), ]
-
-
-class ConvertTLV(Packet):
-    name = "Convert TLV"
-    fields_desc = [_ConvertTLV_HDR, ShortField("padding", 0)]
-
-    def extract_padding(self, s):
-        return '', s
-
-
-class ConvertTLV_Info(ConvertTLV):
-    type = 0x1
-
-
-class ConvertTLV_Error(ConvertTLV):
-    type = 0x1e
-    fields_desc = [_ConvertTLV_HDR, ByteField(
-        "error_code", 0), ByteField("value", 0), ]
-
-
-class ConvertTLV_Connect(ConvertTLV):
-    type = 0xa
-    length = 5
-    fields_desc = [_ConvertTLV_HDR, ShortField(
-        "remote_port", None), IP6Field("remote_addr", None), ]
-
-
-class Convert(Packet):
-    name = "Convert"
-    fields_desc = [ByteField("version", 1),
-                   FieldLenField("total_length", None, length_of="tlvs",
-                                 fmt="B", adjust=lambda _, l: int(1 + l / 4)),
-                   ShortField("magic_no", 8803),
-                   PacketListField("tlvs", None, ConvertTLV)]
+# TCP option kinds, as announced in reply to an INFO TLV
+TCPOPT_MPTCP = 30
+TCPOPT_FASTOPEN = 34
 
 # Utility functions
 
-def read_convert_header(sock):
-    data = sock.recv(CONVERT_HEADER_LENGTH)
-    if len(data) != CONVERT_HEADER_LENGTH:
-        print("Not enough data to read Convert header")
+def build_convert(**tlvs):
+    """
+    Build a Convert message once, for replies that never change. The TLVs
+    are given as the keyword arguments of convert_codec.write().
+    """
+    buffer = bytearray(MSG_MAX_LEN)
+    length = convert_codec.write(buffer, **tlvs)
+    return bytes(buffer[:length])
+
+
+def read_convert_message(sock, parser, buffer):
+    """
+    Read what arrived of the Convert message of sock into parser, using
+    buffer (a bytearray of MSG_MAX_LEN bytes) as scratch space. No more
+    than the message is read: anything after it (e.g. application data
+    pipelined behind the Convert header) stays in the socket.
+
+    Returns the parsed Message once complete, None while the rest has not
+    arrived. Raises ValueError if the message is invalid and
+    ConnectionError if the peer closed the connection first.
+    """
+    length = sock.recv_into(buffer, parser.want())
+    if length == 0:
+        raise ConnectionError("connection closed before the end of the Convert message")
+
+    status, _ = parser.feed(memoryview(buffer)[:length])
+    if status == PARSE_MORE:
         return None
-    header = Convert(data)
-    # Read the TLVs
-    data = sock.recv(header.total_length * 4)
-    # Setup the TLVs
-    # Each TLV is aligned to 4 bytes and has an attribute "length" which is the number of 4 byte words
-    # the TLV takes up including the header
-    # Read each TLV, append it to the list, and move the offset of raw data by the length
-    # of the previous TLV
-    tlvs = []
-    offset = 0
-    while offset < len(data):
-        tlv = ConvertTLV(data[offset:])
-        # make appropriate TLV class subclass
-        if tlv.type == 0x1:
-            tlv = ConvertTLV_Info(bytes(tlv))
-        elif tlv.type == 0x1e:
-            tlv = ConvertTLV_Error(bytes(tlv))
-        elif tlv.type == 0xa:
-            tlv = ConvertTLV_Connect(bytes(tlv))
-        else:
-            print("Unknown TLV type: {}".format(tlv.type))
-        tlvs.append(tlv)
-        offset += tlv.length * 4
-    header.tlvs = tlvs
-    return header
-
-
-def ipv6_to_ipv4(ipv6):
-    return str(ipv6).split(":")[-1]
\ No newline at end of file
+    if status == PARSE_ERROR:
+        raise ValueError("invalid Convert message")
+    return parser.message()
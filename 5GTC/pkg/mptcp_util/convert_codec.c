@@ -0,0 +1,387 @@
+#define PY_SSIZE_T_CLEAN
+
+#include <Python.h>
+#include <structmember.h>
+#include <arpa/inet.h>
+
+#include "convert_util.h"
+
+// Python binding of the Convert codec of lib_convert. Messages are parsed
+// from any buffer (bytes, bytearray, memoryview) and written into a
+// caller-provided writable buffer.
+
+static PyTypeObject *MessageType;
+
+static PyStructSequence_Field message_fields[] = {
+    {"flags", "F_* flags of the TLVs present"},
+    {"remote_addr", "destination of the CONNECT TLV, dotted if IPv4"},
+    {"remote_port", "destination port of the CONNECT TLV"},
+    {"connect_options", "TCP options of the CONNECT TLV"},
+    {"error_code", "code of the ERROR TLV"},
+    {"error_value", "value of the ERROR TLV"},
+    {"tcp_options", "options of the EXTENDED_TCP_HDR TLV"},
+    {"cookie", "opaque data of the COOKIE TLV, padded"},
+    {"supported_tcp_ext", "option kinds of the SUPPORTED_TCP_EXT TLV"},
+    {NULL}};
+
+static PyStructSequence_Desc message_desc = {
+    "convert_codec.Message",
+    "A parsed Convert message; fields of absent TLVs are None",
+    message_fields,
+    9};
+
+static PyObject *bytes_or_none(bool present, const uint8_t *data, size_t len)
+{
+    if (!present)
+        Py_RETURN_NONE;
+    return PyBytes_FromStringAndSize((const char *)data, len);
+}
+
+static PyObject *remote_addr(const struct sockaddr_in6 *addr)
+{
+    char host[INET6_ADDRSTRLEN];
+
+    // v4-mapped destinations are given as IPv4, ready for AF_INET sockets
+    if (IN6_IS_ADDR_V4MAPPED(&addr->sin6_addr))
+        inet_ntop(AF_INET, &addr->sin6_addr.s6_addr[12], host, sizeof(host));
+    else
+        inet_ntop(AF_INET6, &addr->sin6_addr, host, sizeof(host));
+
+    return PyUnicode_FromString(host);
+}
+
+static PyObject *message_new(const struct convert_opts_view *view)
+{
+    bool connect = view->flags & CONVERT_F_CONNECT;
+    bool error = view->flags & CONVERT_F_ERROR;
+    PyObject *msg = PyStructSequence_New(MessageType);
+    PyObject *items[9];
+    int i;
+
+    if (msg == NULL)
+        return NULL;
+
+    items[0] = PyLong_FromLong(view->flags);
+    if (connect)
+    {
+        items[1] = remote_addr(&view->remote_addr);
+        items[2] = PyLong_FromLong(ntohs(view->remote_addr.sin6_port));
+    }
+    else
+    {
+        items[1] = Py_NewRef(Py_None);
+        items[2] = Py_NewRef(Py_None);
+    }
+    items[3] = bytes_or_none(connect, view->connect_options, view->connect_options_len);
+    items[4] = error ? PyLong_FromLong(view->error_code) : Py_NewRef(Py_None);
+    items[5] = bytes_or_none(error, view->error_value, view->error_value_len);
+    items[6] = bytes_or_none(view->flags & CONVERT_F_EXTENDED_TCP_HDR,
+                             view->tcp_options, view->tcp_options_len);
+    items[7] = bytes_or_none(view->flags & CONVERT_F_COOKIE,
+                             view->cookie_data, view->cookie_len);
+    items[8] = bytes_or_none(view->flags & CONVERT_F_SUPPORTED_TCP_EXT,
+                             view->supported_tcp_ext, view->supported_tcp_ext_len);
+
+    for (i = 0; i < 9; i++)
+    {
+        if (items[i] == NULL)
+        {
+            // the slots not set yet are NULL, which the dealloc skips
+            for (; i < 9; i++)
+                Py_XDECREF(items[i]);
+            Py_DECREF(msg);
+            return NULL;
+        }
+        PyStructSequence_SetItem(msg, i, items[i]);
+    }
+
+    return msg;
+}
+
+// Parse the Convert message at the start of buffer
+static PyObject *convert_codec_parse(PyObject *self, PyObject *args)
+{
+    struct convert_opts_view view = {0};
+    size_t tlvs_len;
+    Py_buffer buf;
+    PyObject *msg;
+
+    if (!PyArg_ParseTuple(args, "y*", &buf))
+        return NULL;
+
+    if (convert_parse_header(buf.buf, buf.len, &tlvs_len) < 0 ||
+        CONVERT_HDR_LEN + tlvs_len > (size_t)buf.len ||
+        (tlvs_len && convert_parse_tlvs_view((uint8_t *)buf.buf + CONVERT_HDR_LEN,
+                                             tlvs_len, &view) < 0))
+    {
+        PyBuffer_Release(&buf);
+        PyErr_SetString(PyExc_ValueError, "invalid or incomplete Convert message");
+        return NULL;
+    }
+
+    msg = message_new(&view);
+    PyBuffer_Release(&buf);
+    if (msg == NULL)
+        return NULL;
+
+    return Py_BuildValue("Nn", msg, (Py_ssize_t)(CONVERT_HDR_LEN + tlvs_len));
+}
+
+static int connect_addr(PyObject *connect, struct sockaddr_in6 *addr)
+{
+    const char *host;
+    int port;
+
+    if (!PyArg_ParseTuple(connect, "si", &host, &port))
+        return -1;
+
+    if (port < 0 || port > UINT16_MAX)
+    {
+        PyErr_SetString(PyExc_ValueError, "invalid port");
+        return -1;
+    }
+    addr->sin6_port = htons(port);
+
+    if (inet_pton(AF_INET6, host, &addr->sin6_addr) == 1)
+        return 0;
+
+    // IPv4 destinations are sent v4-mapped
+    addr->sin6_addr.s6_addr[10] = 0xff;
+    addr->sin6_addr.s6_addr[11] = 0xff;
+    if (inet_pton(AF_INET, host, &addr->sin6_addr.s6_addr[12]) == 1)
+        return 0;
+
+    PyErr_Format(PyExc_ValueError, "invalid address: %s", host);
+    return -1;
+}
+
+// Serialize a Convert message into buffer at offset
+static PyObject *convert_codec_write(PyObject *self, PyObject *args, PyObject *kwargs)
+{
+    static char *kwlist[] = {"buffer", "offset", "connect", "connect_options",
+                             "info", "supported_tcp_ext", "cookie", "tcp_options",
+                             "error", "error_value", NULL};
+    struct convert_opts opts = {0};
+    Py_buffer buf, connect_options = {0}, supported = {0}, cookie = {0},
+                   tcp_options = {0}, error_value = {0};
+    PyObject *connect = Py_None;
+    Py_ssize_t offset = 0;
+    int info = 0;
+    int error = -1;
+    size_t room;
+    ssize_t len = -1;
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "w*|n$Oz*pz*z*z*iz*", kwlist,
+                                     &buf, &offset, &connect, &connect_options,
+                                     &info, &supported, &cookie, &tcp_options,
+                                     &error, &error_value))
+        return NULL;
+
+    if (offset < 0 || offset > buf.len)
+    {
+        PyErr_SetString(PyExc_ValueError, "offset out of the buffer");
+        goto out;
+    }
+
+    if (connect != Py_None)
+    {
+        if (connect_addr(connect, &opts.remote_addr) < 0)
+            goto out;
+        opts.flags |= CONVERT_F_CONNECT;
+        opts.connect_options = connect_options.buf;
+        opts.connect_options_len = connect_options.buf ? connect_options.len : 0;
+    }
+    if (info)
+        opts.flags |= CONVERT_F_INFO;
+    if (supported.buf)
+    {
+        opts.flags |= CONVERT_F_SUPPORTED_TCP_EXT;
+        opts.supported_tcp_ext = supported.buf;
+        opts.supported_tcp_ext_len = supported.len;
+    }
+    if (cookie.buf)
+    {
+        opts.flags |= CONVERT_F_COOKIE;
+        opts.cookie_data = cookie.buf;
+        opts.cookie_len = cookie.len;
+    }
+    if (tcp_options.buf)
+    {
+        opts.flags |= CONVERT_F_EXTENDED_TCP_HDR;
+        opts.tcp_options = tcp_options.buf;
+        opts.tcp_options_len = tcp_options.len;
+    }
+    if (error >= 0)
+    {
+        opts.flags |= CONVERT_F_ERROR;
+        opts.error_code = error;
+        opts.error_value = error_value.buf;
+        opts.error_value_len = error_value.buf ? error_value.len : 0;
+    }
+
+    // convert_write() clears the room it is given
+    room = buf.len - offset;
+    if (room > CONVERT_MSG_MAX_LEN)
+        room = CONVERT_MSG_MAX_LEN;
+
+    len = convert_write((uint8_t *)buf.buf + offset, room, &opts);
+    if (len < 0)
+        PyErr_SetString(PyExc_ValueError, "no room in the buffer for the Convert message");
+
+out:
+    PyBuffer_Release(&buf);
+    if (connect_options.buf)
+        PyBuffer_Release(&connect_options);
+    if (supported.buf)
+        PyBuffer_Release(&supported);
+    if (cookie.buf)
+        PyBuffer_Release(&cookie);
+    if (tcp_options.buf)
+        PyBuffer_Release(&tcp_options);
+    if (error_value.buf)
+        PyBuffer_Release(&error_value);
+
+    if (len < 0)
+        return NULL;
+    return PyLong_FromSsize_t(len);
+}
+
+// Resumable parser of a Convert message received in chunks
+typedef struct
+{
+    PyObject_HEAD
+    struct convert_parser parser;
+} ParserObject;
+
+static int Parser_init(ParserObject *self, PyObject *args, PyObject *kwargs)
+{
+    if (!PyArg_ParseTuple(args, ":Parser"))
+        return -1;
+
+    convert_parser_init(&self->parser);
+    return 0;
+}
+
+static PyObject *Parser_feed(ParserObject *self, PyObject *args)
+{
+    size_t consumed;
+    Py_buffer buf;
+    int ret;
+
+    if (!PyArg_ParseTuple(args, "y*", &buf))
+        return NULL;
+
+    ret = convert_parser_feed(&self->parser, buf.buf, buf.len, &consumed);
+    PyBuffer_Release(&buf);
+
+    return Py_BuildValue("in", ret, (Py_ssize_t)consumed);
+}
+
+static PyObject *Parser_want(ParserObject *self, PyObject *Py_UNUSED(args))
+{
+    return PyLong_FromSize_t(convert_parser_want(&self->parser));
+}
+
+static PyObject *Parser_message(ParserObject *self, PyObject *Py_UNUSED(args))
+{
+    if (self->parser.state != CONVERT_PARSER_DONE)
+    {
+        PyErr_SetString(PyExc_ValueError, "no complete Convert message");
+        return NULL;
+    }
+
+    return message_new(&self->parser.opts);
+}
+
+static PyObject *Parser_reset(ParserObject *self, PyObject *Py_UNUSED(args))
+{
+    convert_parser_init(&self->parser);
+    Py_RETURN_NONE;
+}
+
+static PyMethodDef Parser_methods[] = {
+    {"feed", (PyCFunction)Parser_feed, METH_VARARGS,
+     "Feed the next bytes of the stream; returns (PARSE_*, bytes consumed)"},
+    {"want", (PyCFunction)Parser_want, METH_NOARGS,
+     "Bytes missing to make progress; reading no more never takes app data"},
+    {"message", (PyCFunction)Parser_message, METH_NOARGS,
+     "The parsed Message, once feed() returned PARSE_DONE"},
+    {"reset", (PyCFunction)Parser_reset, METH_NOARGS,
+     "Start over with the next message"},
+    {NULL, NULL, 0, NULL} /* Sentinel */
+};
+
+static PyTypeObject ParserType = {
+    PyVarObject_HEAD_INIT(NULL, 0)
+    .tp_name = "convert_codec.Parser",
+    .tp_doc = "Resumable parser of a Convert message received in chunks",
+    .tp_basicsize = sizeof(ParserObject),
+    .tp_flags = Py_TPFLAGS_DEFAULT,
+    .tp_new = PyType_GenericNew,
+    .tp_init = (initproc)Parser_init,
+    .tp_methods = Parser_methods,
+};
+
+// Module method table
+static PyMethodDef ConvertCodecMethods[] = {
+    {"parse", convert_codec_parse, METH_VARARGS,
+     "Parse the Convert message at the start of a buffer; returns (Message, length)"},
+    {"write", (PyCFunction)(void (*)(void))convert_codec_write, METH_VARARGS | METH_KEYWORDS,
+     "Write a Convert message into a writable buffer; returns its length"},
+    {NULL, NULL, 0, NULL} /* Sentinel */
+};
+
+// Module definition
+static struct PyModuleDef convert_codec_module = {
+    PyModuleDef_HEAD_INIT,
+    "convert_codec", /* name of module */
+    "Convert protocol (RFC 8803) codec of lib_convert",
+    -1,
+    ConvertCodecMethods};
+
+// Module initialization
+PyMODINIT_FUNC PyInit_convert_codec(void)
+{
+    PyObject *m;
+
+    if (PyType_Ready(&ParserType) < 0)
+        return NULL;
+
+    MessageType = PyStructSequence_NewType(&message_desc);
+    if (MessageType == NULL)
+        return NULL;
+
+    m = PyModule_Create(&convert_codec_module);
+    if (m == NULL)
+        return NULL;
+
+    if (PyModule_AddObjectRef(m, "Parser", (PyObject *)&ParserType) < 0 ||
+        PyModule_AddObjectRef(m, "Message", (PyObject *)MessageType) < 0 ||
+        PyModule_AddIntConstant(m, "HDR_LEN", CONVERT_HDR_LEN) < 0 ||
+        PyModule_AddIntConstant(m, "MSG_MAX_LEN", CONVERT_MSG_MAX_LEN) < 0 ||
+        PyModule_AddIntConstant(m, "PARSE_ERROR", CONVERT_PARSE_ERROR) < 0 ||
+        PyModule_AddIntConstant(m, "PARSE_MORE", CONVERT_PARSE_MORE) < 0 ||
+        PyModule_AddIntConstant(m, "PARSE_DONE", CONVERT_PARSE_DONE) < 0 ||
+        PyModule_AddIntConstant(m, "F_INFO", CONVERT_F_INFO) < 0 ||
+        PyModule_AddIntConstant(m, "F_CONNECT", CONVERT_F_CONNECT) < 0 ||
+        PyModule_AddIntConstant(m, "F_EXTENDED_TCP_HDR", CONVERT_F_EXTENDED_TCP_HDR) < 0 ||
+        PyModule_AddIntConstant(m, "F_SUPPORTED_TCP_EXT", CONVERT_F_SUPPORTED_TCP_EXT) < 0 ||
+        PyModule_AddIntConstant(m, "F_COOKIE", CONVERT_F_COOKIE) < 0 ||
+        PyModule_AddIntConstant(m, "F_ERROR", CONVERT_F_ERROR) < 0 ||
+        PyModule_AddIntConstant(m, "ERROR_UNSUPPORTED_VERSION", CONVERT_ERROR_UNSUPPORTED_VERSION) < 0 ||
+        PyModule_AddIntConstant(m, "ERROR_MALFORMED_MSG", CONVERT_ERROR_MALFORMED_MSG) < 0 ||
+        PyModule_AddIntConstant(m, "ERROR_UNSUPPORTED_MSG", CONVERT_ERROR_UNSUPPORTED_MSG) < 0 ||
+        PyModule_AddIntConstant(m, "ERROR_MISSING_COOKIE", CONVERT_ERROR_MISSING_COOKIE) < 0 ||
+        PyModule_AddIntConstant(m, "ERROR_UNAUTHORIZED", CONVERT_ERROR_UNAUTHORIZED) < 0 ||
+        PyModule_AddIntConstant(m, "ERROR_UNSUPPORTED_TCP_OPT", CONVERT_ERROR_UNSUPPORTED_TCP_OPT) < 0 ||
+        PyModule_AddIntConstant(m, "ERROR_RESOURCE_EXCEEDED", CONVERT_ERROR_RESOURCE_EXCEEDED) < 0 ||
+        PyModule_AddIntConstant(m, "ERROR_NETWORK_FAILURE", CONVERT_ERROR_NETWORK_FAILURE) < 0 ||
+        PyModule_AddIntConstant(m, "ERROR_CONN_RESET", CONVERT_ERROR_CONN_RESET) < 0 ||
+        PyModule_AddIntConstant(m, "ERROR_DEST_UNREACH", CONVERT_ERROR_DEST_UNREACH) < 0)
+    {
+        Py_DECREF(m);
+        return NULL;
+    }
+
+    return m;
+}
@@ -1,9 +1,19 @@
 from distutils.core import setup, Extension
 
+# the Convert codec is shared with lib_convert
+LIB_CONVERT = '../../../lib_convert'
+
 mptcp_util = Extension('mptcp_util',
                        sources=['mptcp_util.c'])
 
+convert_codec = Extension('convert_codec',
+                          sources=['convert_codec.c',
+                                   LIB_CONVERT + '/convert_util.c',
+                                   LIB_CONVERT + '/convert_log.c'],
+                          include_dirs=[LIB_CONVERT],
+                          define_macros=[('CONVERT_LOG_LEVEL', 'CONVERT_LOG_OFF')])
+
 setup(name='mptcp_util',
       version='1.0',
       description='MPTCP Utility functions',
-      ext_modules=[mptcp_util])
+      ext_modules=[mptcp_util, convert_codec])
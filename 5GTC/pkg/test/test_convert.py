@@ -0,0 +1,71 @@
+# Tests for the Convert Protocol codec
+
+import socket
+import unittest
+import convert_codec
+from pkg.convert import (
+    Parser,
+    build_convert,
+    read_convert_message,
+    MSG_MAX_LEN,
+    F_INFO,
+    F_CONNECT,
+    F_COOKIE,
+    TCPOPT_MPTCP,
+    TCPOPT_FASTOPEN
+)
+
+class TestConvertCodec(unittest.TestCase):
+    def test_round_trip(self):
+        buffer = bytearray(MSG_MAX_LEN)
+        length = convert_codec.write(buffer, connect=("10.0.0.1", 8080), cookie=b"cookie")
+
+        msg, parsed = convert_codec.parse(buffer[:length])
+        self.assertEqual(parsed, length)
+        self.assertEqual(msg.flags, F_CONNECT | F_COOKIE)
+        # IPv4 destinations are sent v4-mapped and come back unmapped
+        self.assertEqual(msg.remote_addr, "10.0.0.1")
+        self.assertEqual(msg.remote_port, 8080)
+        self.assertEqual(msg.cookie[:6], b"cookie")
+
+    def test_error_padding(self):
+        buffer = bytearray(MSG_MAX_LEN)
+
+        # The alignment padding is not part of the error value
+        length = convert_codec.write(buffer, error=2)
+        msg, _ = convert_codec.parse(buffer[:length])
+        self.assertEqual(msg.error_code, 2)
+        self.assertEqual(msg.error_value, b"")
+
+        length = convert_codec.write(buffer, error=3, error_value=bytes([TCPOPT_MPTCP, TCPOPT_FASTOPEN]))
+        msg, _ = convert_codec.parse(buffer[:length])
+        self.assertEqual(list(msg.error_value), [TCPOPT_MPTCP, TCPOPT_FASTOPEN])
+
+    def test_invalid(self):
+        with self.assertRaises(ValueError):
+            convert_codec.parse(b"\x00" * 8)
+
+    def test_read_split(self):
+        client, server = socket.socketpair()
+        info = build_convert(info=True)
+        reply = build_convert(supported_tcp_ext=bytes([TCPOPT_MPTCP, TCPOPT_FASTOPEN]))
+        parser = Parser()
+        buffer = bytearray(MSG_MAX_LEN)
+
+        # The message arrives one byte at a time, with data pipelined behind it
+        msg = None
+        for i in range(len(info)):
+            client.send(info[i:i + 1] + (reply if i == len(info) - 1 else b""))
+            msg = read_convert_message(server, parser, buffer)
+        self.assertIsNotNone(msg)
+        self.assertEqual(msg.flags, F_INFO)
+
+        # What follows the message is left in the socket
+        msg, _ = convert_codec.parse(server.recv(MSG_MAX_LEN))
+        self.assertEqual(list(msg.supported_tcp_ext), [TCPOPT_MPTCP, TCPOPT_FASTOPEN])
+
+        client.close()
+        server.close()
+
+if __name__ == "__main__":
+    unittest.main()
@@ -0,0 +1,398 @@
+/**
+ * Copyright(c) 2019, Tessares S.A.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ * list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and / or other materials provided with the distribution.
+ *
+ * 3. Neither the name of the copyright holder nor the names of its
+ * contributors may be used to endorse or promote products derived from
+ * this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED.IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ *        SERVICES; LOSS OF USE, DATA, OR PROFITS;
+ *        OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT(INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+#define _GNU_SOURCE
+#include <arpa/inet.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "convert_api.h"
+#include "convert_log.h"
+
+enum
+{
+	API_CONNECTING = 0,	/* connection to the converter in progress */
+	API_SEND,			/* Convert message not completely sent */
+	API_RECV,			/* reading the converter's reply */
+};
+
+struct api_handshake
+{
+	int stage;
+	/* the socket is non-blocking */
+	bool nonblock;
+
+	uint8_t tx[CONVERT_MSG_MAX_LEN];
+	size_t tx_len;
+	size_t tx_off;
+
+	/* the reply is read exactly, leaving the app data in the socket */
+	struct convert_parser rx;
+};
+
+/* handshakes in progress, indexed by fd */
+static struct api_handshake **_handshakes;
+static size_t _handshake_slots;
+static pthread_mutex_t _handshake_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static struct api_handshake *
+_lookup(int fd)
+{
+	struct api_handshake *hs = NULL;
+
+	pthread_mutex_lock(&_handshake_lock);
+	if (fd >= 0 && (size_t)fd < _handshake_slots)
+		hs = _handshakes[fd];
+	pthread_mutex_unlock(&_handshake_lock);
+
+	return hs;
+}
+
+static int
+_store(int fd, struct api_handshake *hs)
+{
+	int ret = 0;
+
+	pthread_mutex_lock(&_handshake_lock);
+	if ((size_t)fd >= _handshake_slots)
+	{
+		size_t slots = _handshake_slots ? _handshake_slots : 64;
+		struct api_handshake **handshakes;
+
+		while (slots <= (size_t)fd)
+			slots *= 2;
+
+		handshakes = realloc(_handshakes, slots * sizeof(*handshakes));
+		if (!handshakes)
+		{
+			ret = -1;
+			goto out;
+		}
+
+		memset(handshakes + _handshake_slots, 0,
+			   (slots - _handshake_slots) * sizeof(*handshakes));
+		_handshakes = handshakes;
+		_handshake_slots = slots;
+	}
+	_handshakes[fd] = hs;
+
+out:
+	pthread_mutex_unlock(&_handshake_lock);
+	return ret;
+}
+
+void
+convert_connect_abort(int fd)
+{
+	struct api_handshake *hs = _lookup(fd);
+
+	if (!hs)
+		return;
+
+	_store(fd, NULL);
+	free(hs);
+}
+
+static ssize_t
+_write_connect(uint8_t *buf, size_t len, const struct sockaddr *dest,
+			   const struct convert_connect_opts *opts)
+{
+	struct convert_opts copts = {
+		.flags = CONVERT_F_CONNECT,
+	};
+	ssize_t ret;
+
+	switch (dest->sa_family)
+	{
+	case AF_INET:
+	{
+		const struct sockaddr_in *in = (const struct sockaddr_in *)dest;
+
+		/* already in network bytes */
+		copts.remote_addr.sin6_addr = (struct in6_addr){
+			.s6_addr32 = {0, 0, htonl(0xffff), in->sin_addr.s_addr},
+		};
+		copts.remote_addr.sin6_port = in->sin_port;
+		break;
+	}
+	case AF_INET6:
+		memcpy(&copts.remote_addr, dest, sizeof(copts.remote_addr));
+		break;
+	default:
+		errno = EAFNOSUPPORT;
+		return -1;
+	}
+
+	if (opts->cookie)
+	{
+		copts.flags |= CONVERT_F_COOKIE;
+		copts.cookie_data = (uint8_t *)opts->cookie;
+		copts.cookie_len = opts->cookie_len;
+	}
+
+	ret = convert_write(buf, len, &copts);
+	if (ret < 0)
+		errno = EMSGSIZE;
+	return ret;
+}
+
+int
+convert_connect_start(int fd, const struct sockaddr *dest,
+					  const struct convert_connect_opts *opts)
+{
+	struct api_handshake *hs;
+	ssize_t len;
+	int fl;
+
+	if (!dest || !opts || !opts->converter)
+	{
+		errno = EINVAL;
+		return -1;
+	}
+
+	if (_lookup(fd))
+	{
+		errno = EALREADY;
+		return -1;
+	}
+
+	fl = fcntl(fd, F_GETFL);
+	if (fl < 0)
+		return -1;
+
+	hs = calloc(1, sizeof(*hs));
+	if (!hs)
+		return -1;
+
+	hs->nonblock = fl & O_NONBLOCK;
+	convert_parser_init(&hs->rx);
+
+	len = _write_connect(hs->tx, sizeof(hs->tx), dest, opts);
+	if (len < 0)
+		goto error;
+	hs->tx_len = len;
+
+	if (opts->fastopen)
+	{
+		ssize_t ret = sendto(fd, hs->tx, hs->tx_len, MSG_FASTOPEN | MSG_NOSIGNAL,
+							 opts->converter, opts->converter_len);
+
+		if (ret >= 0)
+		{
+			hs->tx_off = ret;
+			hs->stage = API_SEND;
+		}
+		else if (errno == EINPROGRESS)
+			/* SYN sent without data, the message follows */
+			hs->stage = API_CONNECTING;
+		else
+			goto error;
+	}
+	else if (connect(fd, opts->converter, opts->converter_len) == 0)
+		hs->stage = API_SEND;
+	else if (errno == EINPROGRESS)
+		hs->stage = API_CONNECTING;
+	else
+		goto error;
+
+	if (_store(fd, hs) < 0)
+		goto error;
+
+	log_debug("fd %d: convert handshake started", fd);
+	return 0;
+
+error:
+	free(hs);
+	return -1;
+}
+
+static int
+_connecting(int fd, struct api_handshake *hs)
+{
+	struct pollfd pfd = {.fd = fd, .events = POLLOUT};
+	socklen_t len = sizeof(int);
+	int error = 0;
+	int ret;
+
+	ret = poll(&pfd, 1, hs->nonblock ? 0 : -1);
+	if (ret < 0)
+		return -1;
+	if (ret == 0)
+	{
+		errno = EAGAIN;
+		return -1;
+	}
+
+	if (getsockopt(fd, SOL_SOCKET, SO_ERROR, &error, &len) < 0)
+		return -1;
+	if (error)
+	{
+		errno = error;
+		return -1;
+	}
+
+	hs->stage = API_SEND;
+	return 0;
+}
+
+static int
+_send(int fd, struct api_handshake *hs)
+{
+	ssize_t ret;
+
+	ret = send(fd, hs->tx + hs->tx_off, hs->tx_len - hs->tx_off, MSG_NOSIGNAL);
+	if (ret < 0)
+		return -1;
+
+	hs->tx_off += ret;
+	if (hs->tx_off == hs->tx_len)
+		hs->stage = API_RECV;
+	return 0;
+}
+
+/* Read the reply. Returns 1 once it is complete. */
+static int
+_recv(int fd, struct api_handshake *hs)
+{
+	uint8_t buff[CONVERT_MSG_MAX_LEN];
+	ssize_t ret;
+
+	ret = recv(fd, buff, convert_parser_want(&hs->rx), 0);
+	if (ret < 0)
+		return -1;
+	if (ret == 0)
+	{
+		/* the converter closes the connection when it is unable to
+		 * reach the destination.
+		 */
+		errno = ECONNREFUSED;
+		return -1;
+	}
+
+	switch (convert_parser_feed(&hs->rx, buff, ret, NULL))
+	{
+	case CONVERT_PARSE_MORE:
+		return 0;
+	case CONVERT_PARSE_DONE:
+		return 1;
+	default:
+		errno = EPROTO;
+		return -1;
+	}
+}
+
+int
+convert_connect_complete(int fd, struct convert_opts **reply)
+{
+	struct api_handshake *hs = _lookup(fd);
+	struct convert_opts *opts = NULL;
+	int ret = 0;
+
+	if (reply)
+		*reply = NULL;
+
+	if (!hs)
+	{
+		errno = EINVAL;
+		return -1;
+	}
+
+	while (ret == 0)
+	{
+		switch (hs->stage)
+		{
+		case API_CONNECTING:
+			ret = _connecting(fd, hs);
+			break;
+		case API_SEND:
+			ret = _send(fd, hs);
+			break;
+		case API_RECV:
+			ret = _recv(fd, hs);
+			break;
+		}
+	}
+
+	if (ret < 0)
+	{
+		if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)
+			return -1;
+		goto out;
+	}
+
+	if (hs->rx.len > CONVERT_HDR_LEN)
+	{
+		opts = convert_opts_from_view(&hs->rx.opts);
+		if (!opts)
+		{
+			errno = ENOMEM;
+			ret = -1;
+			goto out;
+		}
+
+		if (opts->flags & CONVERT_F_ERROR)
+		{
+			log_debug("fd %d: convert error %u", fd, opts->error_code);
+			errno = convert_error_to_errno(opts->error_code);
+			ret = -1;
+			goto out;
+		}
+	}
+
+	ret = 0;
+
+out:
+	if (reply)
+		*reply = opts;
+	else if (opts)
+		convert_free_opts(opts);
+
+	convert_connect_abort(fd);
+	return ret;
+}
+
+int
+convert_connect_events(int fd)
+{
+	struct api_handshake *hs = _lookup(fd);
+
+	if (!hs)
+		return 0;
+
+	return hs->stage == API_RECV ? POLLIN : POLLOUT;
+}
@@ -0,0 +1,95 @@
+/**
+ * Copyright(c) 2019, Tessares S.A.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ * list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and / or other materials provided with the distribution.
+ *
+ * 3. Neither the name of the copyright holder nor the names of its
+ * contributors may be used to endorse or promote products derived from
+ * this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED.IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ *        SERVICES; LOSS OF USE, DATA, OR PROFITS;
+ *        OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT(INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+/* Native Convert client API.
+ *
+ * Applies the Convert protocol to a socket owned by the caller, without
+ * interposing any libc function: link with libconvert instead of
+ * preloading lib_convert.so. The handshake follows the blocking mode of
+ * the socket. On a non-blocking socket, convert_connect_complete()
+ * returns EAGAIN until it is done; wait for convert_connect_events() on
+ * the socket, from poll, epoll or an io_uring poll request, and call it
+ * again.
+ *
+ *   convert_connect_start(fd, dest, &opts);
+ *   while (convert_connect_complete(fd, &reply) < 0 && errno == EAGAIN)
+ *       wait for convert_connect_events(fd) on fd;
+ *
+ * Once it is done, the socket carries the app data to and from dest.
+ */
+
+#ifndef _CONVERT_API_H_
+#define _CONVERT_API_H_
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <sys/socket.h>
+
+#include "convert_util.h"
+
+struct convert_connect_opts
+{
+	/* the converter */
+	const struct sockaddr *converter;
+	socklen_t converter_len;
+
+	/* sent in a Cookie TLV unless NULL */
+	const uint8_t *cookie;
+	size_t cookie_len;
+
+	/* send the Convert message in the SYN */
+	bool fastopen;
+};
+
+/* Start connecting fd, a SOCK_STREAM socket not connected yet, to the
+ * AF_INET or AF_INET6 dest through the converter. Returns -1 with errno
+ * set on failure.
+ */
+int convert_connect_start(int fd, const struct sockaddr *dest,
+						  const struct convert_connect_opts *opts);
+
+/* Go on with the handshake. Returns 0 once the converter accepted the
+ * connection, or -1 with errno set: EAGAIN when the socket is not ready,
+ * the errno matching the Convert error when the converter refused it.
+ * The handshake state is released when it does not return EAGAIN. If
+ * reply is not NULL, it receives the TLVs of the converter's reply, to be
+ * freed with convert_free_opts(), or NULL if there was none.
+ */
+int convert_connect_complete(int fd, struct convert_opts **reply);
+
+/* Poll events the handshake of fd waits for, 0 if there is none. */
+int convert_connect_events(int fd);
+
+/* Release the handshake state of fd, e.g. before closing it. */
+void convert_connect_abort(int fd);
+
+#endif
@@ -0,0 +1,363 @@
+/**
+ * Copyright(c) 2019, Tessares S.A.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ * list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and / or other materials provided with the distribution.
+ *
+ * 3. Neither the name of the copyright holder nor the names of its
+ * contributors may be used to endorse or promote products derived from
+ * this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED.IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ *        SERVICES; LOSS OF USE, DATA, OR PROFITS;
+ *        OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT(INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+
+/* convert_bench: throughput of the Convert codec on the messages of a
+ * handshake.
+ *
+ *   convert_bench [iterations]
+ *
+ * Each operation of the codec runs over a few TLV mixes, and reports its
+ * time per message, messages per second and heap allocations per message.
+ * read_convert_opts() goes through a socketpair and runs a hundredth of
+ * the iterations.
+ */
+
+#define _GNU_SOURCE
+#include <arpa/inet.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "convert_util.h"
+
+#define BENCH_ITERATIONS 1000000
+#define BENCH_SYSCALL_DIVISOR 100
+
+/* A message of the benchmark, with the options it was written from. */
+struct bench_msg
+{
+	const char *name;
+	struct convert_opts opts;
+	uint8_t buff[CONVERT_MSG_MAX_LEN];
+	size_t len;
+	struct convert_template tmpl;
+	/* socketpair for read_convert_opts() */
+	int fds[2];
+};
+
+struct bench_op
+{
+	const char *name;
+	bool (*run)(struct bench_msg *msg);
+	/* only for messages with a CONNECT TLV */
+	bool connect_only;
+	bool syscalls;
+};
+
+static uint8_t _cookie[] = "0123456789abcdef";
+/* MSS, SACK permitted and window scale, as a converter echoes them */
+static uint8_t _tcp_options[] = { 2, 4, 0x05, 0xb4, 4, 2, 3, 3, 7, 0, 0, 0 };
+
+/* heap allocations made by the codec, counted through the linker's
+ * --wrap of the allocator
+ */
+static unsigned long _allocs;
+
+void *__real_malloc(size_t size);
+void *__real_calloc(size_t nmemb, size_t size);
+void *__real_realloc(void *ptr, size_t size);
+
+void *
+__wrap_malloc(size_t size)
+{
+	_allocs++;
+	return __real_malloc(size);
+}
+
+void *
+__wrap_calloc(size_t nmemb, size_t size)
+{
+	_allocs++;
+	return __real_calloc(nmemb, size);
+}
+
+void *
+__wrap_realloc(void *ptr, size_t size)
+{
+	_allocs++;
+	return __real_realloc(ptr, size);
+}
+
+static long
+_now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000L + ts.tv_nsec;
+}
+
+/* keep the compiler from optimizing out a result */
+#define BENCH_KEEP(p) __asm__ volatile("" : : "r"(p) : "memory")
+
+static bool
+_parse_header(struct bench_msg *msg)
+{
+	size_t length;
+
+	return convert_parse_header(msg->buff, msg->len, &length) == 0 &&
+		   length == msg->len - CONVERT_HDR_LEN;
+}
+
+static bool
+_parse_tlvs(struct bench_msg *msg)
+{
+	struct convert_opts *opts;
+
+	opts = convert_parse_tlvs(msg->buff + CONVERT_HDR_LEN,
+							  msg->len - CONVERT_HDR_LEN);
+	if (!opts)
+		return false;
+
+	BENCH_KEEP(opts);
+	convert_free_opts(opts);
+	return true;
+}
+
+static bool
+_parse_tlvs_view(struct bench_msg *msg)
+{
+	struct convert_opts_view view;
+
+	if (convert_parse_tlvs_view(msg->buff + CONVERT_HDR_LEN,
+								msg->len - CONVERT_HDR_LEN, &view) < 0)
+		return false;
+
+	BENCH_KEEP(&view);
+	return true;
+}
+
+static bool
+_parser_feed(struct bench_msg *msg)
+{
+	struct convert_parser parser;
+	size_t consumed;
+
+	convert_parser_init(&parser);
+	if (convert_parser_feed(&parser, msg->buff, msg->len, &consumed) !=
+		CONVERT_PARSE_DONE)
+		return false;
+
+	BENCH_KEEP(&parser);
+	return consumed == msg->len;
+}
+
+static bool
+_write(struct bench_msg *msg)
+{
+	uint8_t buff[CONVERT_MSG_MAX_LEN];
+
+	if (convert_write(buff, sizeof(buff), &msg->opts) != (ssize_t)msg->len)
+		return false;
+
+	BENCH_KEEP(buff);
+	return true;
+}
+
+static bool
+_template_write(struct bench_msg *msg)
+{
+	struct sockaddr_in6 dest = msg->opts.remote_addr;
+	uint8_t buff[CONVERT_MSG_MAX_LEN];
+
+	dest.sin6_family = AF_INET6;
+	if (convert_template_write(&msg->tmpl, buff, sizeof(buff),
+							   (struct sockaddr *)&dest) != (ssize_t)msg->len)
+		return false;
+
+	BENCH_KEEP(buff);
+	return true;
+}
+
+static bool
+_read_convert_opts(struct bench_msg *msg)
+{
+	struct convert_opts *opts;
+	char error_message[128];
+	int error_code;
+
+	if (write(msg->fds[0], msg->buff, msg->len) != (ssize_t)msg->len)
+		return false;
+
+	opts = read_convert_opts(msg->fds[1], &error_code, error_message);
+	if (opts)
+		convert_free_opts(opts);
+
+	/* an error TLV is reported as such */
+	return error_code == ((msg->opts.flags & CONVERT_F_ERROR)
+							  ? msg->opts.error_code
+							  : 0);
+}
+
+static const struct bench_op _ops[] = {
+	{ "convert_parse_header", _parse_header, false, false },
+	{ "convert_parse_tlvs", _parse_tlvs, false, false },
+	{ "convert_parse_tlvs_view", _parse_tlvs_view, false, false },
+	{ "convert_parser_feed", _parser_feed, false, false },
+	{ "convert_write", _write, false, false },
+	{ "convert_template_write", _template_write, true, false },
+	{ "read_convert_opts", _read_convert_opts, false, true },
+};
+
+static struct bench_msg _msgs[] = {
+	{
+		.name = "connect",
+		.opts = {
+			.flags = CONVERT_F_CONNECT,
+		},
+	},
+	{
+		.name = "cookie",
+		.opts = {
+			.flags = CONVERT_F_CONNECT | CONVERT_F_COOKIE,
+			.cookie_data = _cookie,
+			.cookie_len = sizeof(_cookie) - 1,
+		},
+	},
+	{
+		.name = "ext tcp hdr",
+		.opts = {
+			.flags = CONVERT_F_CONNECT | CONVERT_F_EXTENDED_TCP_HDR,
+			.tcp_options = _tcp_options,
+			.tcp_options_len = sizeof(_tcp_options),
+		},
+	},
+	{
+		.name = "error",
+		.opts = {
+			.flags = CONVERT_F_ERROR,
+			.error_code = CONVERT_ERROR_DEST_UNREACH,
+		},
+	},
+};
+
+#define BENCH_MSGS (sizeof(_msgs) / sizeof(_msgs[0]))
+#define BENCH_OPS (sizeof(_ops) / sizeof(_ops[0]))
+
+static int
+_msg_init(struct bench_msg *msg)
+{
+	ssize_t len;
+
+	if (msg->opts.flags & CONVERT_F_CONNECT)
+	{
+		msg->opts.remote_addr.sin6_port = htons(443);
+		inet_pton(AF_INET6, "2001:db8::1", &msg->opts.remote_addr.sin6_addr);
+
+		if (convert_template_init(&msg->tmpl, &msg->opts) < 0)
+			return -1;
+	}
+
+	len = convert_write(msg->buff, sizeof(msg->buff), &msg->opts);
+	if (len < 0)
+		return -1;
+	msg->len = len;
+
+	return socketpair(AF_UNIX, SOCK_STREAM, 0, msg->fds);
+}
+
+static int
+_bench(const struct bench_op *op, struct bench_msg *msg, long iterations)
+{
+	unsigned long allocs;
+	double ns;
+	long start;
+	long i;
+
+	if (op->syscalls)
+		iterations = iterations / BENCH_SYSCALL_DIVISOR ?: 1;
+
+	allocs = _allocs;
+	start = _now_ns();
+	for (i = 0; i < iterations; i++)
+	{
+		if (!op->run(msg))
+		{
+			fprintf(stderr, "%s failed on the %s message\n", op->name,
+					msg->name);
+			return -1;
+		}
+	}
+	ns = (double)(_now_ns() - start) / iterations;
+
+	printf("%-24s %-12s %4zu %10.1f %12.0f %10.2f\n", op->name, msg->name,
+		   msg->len, ns, 1e9 / ns, (double)(_allocs - allocs) / iterations);
+	return 0;
+}
+
+int
+main(int argc, char *argv[])
+{
+	long iterations = BENCH_ITERATIONS;
+	size_t i, j;
+
+	if (argc > 1)
+		iterations = strtol(argv[1], NULL, 10);
+	if (iterations <= 0)
+	{
+		fprintf(stderr, "usage: %s [iterations]\n", argv[0]);
+		return 1;
+	}
+
+	for (j = 0; j < BENCH_MSGS; j++)
+	{
+		if (_msg_init(&_msgs[j]) < 0)
+		{
+			fprintf(stderr, "unable to build the %s message: %s\n",
+					_msgs[j].name, strerror(errno));
+			return 1;
+		}
+	}
+
+	printf("%-24s %-12s %4s %10s %12s %10s\n", "operation", "message",
+		   "len", "ns/op", "msgs/s", "allocs/op");
+
+	for (i = 0; i < BENCH_OPS; i++)
+	{
+		for (j = 0; j < BENCH_MSGS; j++)
+		{
+			if (_ops[i].connect_only &&
+				!(_msgs[j].opts.flags & CONVERT_F_CONNECT))
+				continue;
+
+			if (_bench(&_ops[i], &_msgs[j], iterations) < 0)
+				return 1;
+		}
+	}
+
+	return 0;
+}
@@ -37,7 +37,9 @@
 #include <fcntl.h>
 #include <netdb.h>
 #include <netinet/in.h>
+#include <poll.h>
 #include <pthread.h>
+#include <stdatomic.h>
 #include <stdbool.h>
 #include <stdlib.h>
 #include <stdio.h>
@@ -45,7 +47,11 @@
 #include <syscall.h>
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/resource.h>
+#include <sys/sendfile.h>
+#include <sys/uio.h>
 #include <sys/utsname.h>
+#include <time.h>
 #include <unistd.h>
 #include <stdarg.h>
 #include <dlfcn.h>
@@ -56,105 +62,301 @@
 
 #include "convert.h"
 #include "convert_util.h"
-#include "bsd_queue.h"
+#include "convert_client.h"
+#include "convert_log.h"
+#include "convert_stats.h"
 
 #define CONVERT_PORT "1234"
 
-enum
-{
-	SYSCALL_SKIP = 0,
-	SYSCALL_RUN = 1,
-};
+/* Upper bound on the size of the fd-indexed socket table. */
+#define CONVERT_MAX_FDS (1 << 20)
 
-/* State for each created TCP-based socket */
-typedef struct socket_state
-{
-	LIST_ENTRY(socket_state)
-	list;
-	int fd;
-	int established;
-} socket_state_t;
+struct convert_syscalls convert_sys;
 
-#define NUM_BUCKETS 1024
-static LIST_HEAD(socket_htbl_t, socket_state) _socket_htable[NUM_BUCKETS];
-/* note: global hash table mutex, improvement: lock per bucket */
-static pthread_mutex_t _socket_htable_mutex = PTHREAD_MUTEX_INITIALIZER;
+_Atomic(socket_state_t *) *convert_socket_table;
+size_t convert_socket_table_size;
+atomic_int convert_socket_count;
 
-static struct addrinfo *_converter_addr;
 static const char *_convert_port = CONVERT_PORT;
 static const char *_convert_cookie = NULL;
+/* the Convert message sent on each redirect, built by _validate_config() */
+static struct convert_template _connect_template;
 
-static FILE *_log;
-static pthread_mutex_t _log_mutex = PTHREAD_MUTEX_INITIALIZER;
+/* CONVERT_FASTOPEN=1: send the CONNECT TLV in the SYN. Cleared at
+ * runtime if a fastopen connection falls back to plain TCP.
+ */
+static atomic_bool _convert_fastopen;
 
-static int
-_hash(int fd)
+/* CONVERT_PIPELINE=1: hold the Convert message back until the app's
+ * first write so that both leave in one segment. connect() no longer
+ * waits for the reply, which is checked by the first read instead.
+ */
+static bool _convert_pipeline;
+
+/* CONVERT_OPTIMISTIC=1: connect() returns once the Convert message is
+ * sent; the reply, and any Convert error it carries, is consumed by the
+ * first read.
+ */
+static bool _convert_optimistic;
+
+/* CONVERT_UPGRADE_TCP=1: create MPTCP sockets for the app's TCP ones and
+ * manage them. Cleared at runtime if the kernel does not support MPTCP.
+ */
+static atomic_bool _convert_upgrade_tcp;
+
+static int _kernel_version;
+static int _kernel_major;
+
+/* The configuration is validated by the first managed connect, so that
+ * processes that never make one do not pay for it. When it is invalid,
+ * connects go straight to their destination.
+ */
+static pthread_once_t _setup_once = PTHREAD_ONCE_INIT;
+static bool _convert_ready;
+static pthread_once_t _stats_once = PTHREAD_ONCE_INIT;
+
+void
+convert_resolve_syscalls(void)
 {
-	return fd % NUM_BUCKETS;
+	convert_sys.socket = dlsym(RTLD_NEXT, "socket");
+	convert_sys.connect = dlsym(RTLD_NEXT, "connect");
+	convert_sys.close = dlsym(RTLD_NEXT, "close");
+	convert_sys.send = dlsym(RTLD_NEXT, "send");
+	convert_sys.recv = dlsym(RTLD_NEXT, "recv");
+	convert_sys.sendmsg = dlsym(RTLD_NEXT, "sendmsg");
+	convert_sys.recvfrom = dlsym(RTLD_NEXT, "recvfrom");
+	convert_sys.recvmsg = dlsym(RTLD_NEXT, "recvmsg");
+	convert_sys.sendto = dlsym(RTLD_NEXT, "sendto");
+	convert_sys.read = dlsym(RTLD_NEXT, "read");
+	convert_sys.readv = dlsym(RTLD_NEXT, "readv");
+	convert_sys.write = dlsym(RTLD_NEXT, "write");
+	convert_sys.writev = dlsym(RTLD_NEXT, "writev");
+	convert_sys.sendfile = dlsym(RTLD_NEXT, "sendfile");
+	convert_sys.sendfile64 = dlsym(RTLD_NEXT, "sendfile64");
+	convert_sys.splice = dlsym(RTLD_NEXT, "splice");
+	convert_sys.poll = dlsym(RTLD_NEXT, "poll");
+	convert_sys.select = dlsym(RTLD_NEXT, "select");
+	convert_sys.epoll_ctl = dlsym(RTLD_NEXT, "epoll_ctl");
+	convert_sys.epoll_wait = dlsym(RTLD_NEXT, "epoll_wait");
+	convert_sys.epoll_pwait = dlsym(RTLD_NEXT, "epoll_pwait");
 }
 
-static socket_state_t *
-_lookup(int fd)
+static long
+_now_us(void)
 {
-	int hash = _hash(fd);
-	socket_state_t *state = NULL;
-	socket_state_t *ret = NULL;
+	struct timespec ts;
 
-	pthread_mutex_lock(&_socket_htable_mutex);
-	LIST_FOREACH(state, &_socket_htable[hash], list)
-	{
-		if (state->fd == fd)
-		{
-			ret = state;
-			break;
-		}
-	}
-	pthread_mutex_unlock(&_socket_htable_mutex);
-	return ret;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
 }
 
 static void
-_alloc(int fd)
+_alloc_table(void)
 {
-	socket_state_t *state;
-	int hash = _hash(fd);
+	struct rlimit rlim;
+	size_t size = CONVERT_MAX_FDS;
 
-	state = (socket_state_t *)malloc(sizeof(*state));
-	if (!state)
-		return;
+	if (getrlimit(RLIMIT_NOFILE, &rlim) == 0 && rlim.rlim_max != RLIM_INFINITY &&
+		rlim.rlim_max < size)
+		size = rlim.rlim_max;
 
-	printf("allocate state for fd %d\n", fd);
+	/* large enough to be served by zeroed, lazily committed pages */
+	convert_socket_table = calloc(size, sizeof(*convert_socket_table));
+	if (convert_socket_table)
+		convert_socket_table_size = size;
+}
 
-	state->fd = fd;
+static void
+_stats_setup(void)
+{
+	const char *convert_stats_enabled = getenv("CONVERT_STATS");
 
-	pthread_mutex_lock(&_socket_htable_mutex);
-	LIST_INSERT_HEAD(&_socket_htable[hash], state, list);
-	pthread_mutex_unlock(&_socket_htable_mutex);
+	if (convert_stats_enabled && strcmp(convert_stats_enabled, "1") == 0 &&
+		convert_stats_init() < 0)
+		log_warn("unable to create the statistics segment: %s",
+				 strerror(errno));
 }
 
+/* Stop managing the socket, handing the app's epoll registration back
+ * to the kernel. The state is left in the table for close() to free.
+ */
 static void
-_free_state(socket_state_t *state)
+_release_state(socket_state_t *state)
 {
-	pthread_mutex_lock(&_socket_htable_mutex);
-	LIST_REMOVE(state, list);
-	pthread_mutex_unlock(&_socket_htable_mutex);
+	if (atomic_exchange_explicit(&state->released, true, memory_order_acq_rel))
+		return;
 
+	log_trace("release state for fd %d", state->fd);
+
+	convert_endpoint_put(state->endpoint);
+	state->endpoint = -1;
+	convert_epoll_release(state, true);
+	atomic_fetch_sub_explicit(&convert_socket_count, 1, memory_order_relaxed);
+}
+
+/* Free a state taken out of the table. */
+static void
+_destroy(socket_state_t *state)
+{
+	if (!atomic_exchange_explicit(&state->released, true, memory_order_acq_rel))
+	{
+		convert_endpoint_put(state->endpoint);
+		convert_epoll_release(state, false);
+		atomic_fetch_sub_explicit(&convert_socket_count, 1,
+								  memory_order_relaxed);
+	}
+	pthread_mutex_destroy(&state->lock);
 	free(state);
 }
 
+static socket_state_t *
+_alloc(int fd)
+{
+	socket_state_t *state;
+	socket_state_t *old;
+
+	if ((size_t)fd >= convert_socket_table_size)
+		return NULL;
+
+	pthread_once(&_stats_once, _stats_setup);
+
+	state = (socket_state_t *)calloc(1, sizeof(*state));
+	if (!state)
+		return NULL;
+
+	log_trace("allocate state for fd %d", fd);
+
+	state->fd = fd;
+	state->ep_fd = -1;
+	state->ep_tag_fd = -1;
+	state->policy_rule = -1;
+	state->endpoint = -1;
+	pthread_mutex_init(&state->lock, NULL);
+
+	/* a stale state is left behind if the fd was closed without going
+	 * through close(), e.g. by dup2(), or released.
+	 */
+	atomic_fetch_add_explicit(&convert_socket_count, 1, memory_order_relaxed);
+	old = atomic_exchange_explicit(&convert_socket_table[fd], state,
+								   memory_order_acq_rel);
+	if (old)
+		_destroy(old);
+
+	convert_stat_inc(CONVERT_STAT_SOCKETS);
+	return state;
+}
+
 static void
 _free(int fd)
 {
 	socket_state_t *state;
 
-	state = _lookup(fd);
-	if (!state)
+	if ((size_t)fd >= convert_socket_table_size ||
+		!atomic_load_explicit(&convert_socket_table[fd], memory_order_relaxed))
 		/* no state associated with this fd. */
 		return;
 
-	printf("release state for fd %d\n", fd);
+	state = atomic_exchange_explicit(&convert_socket_table[fd], NULL,
+									 memory_order_acq_rel);
+	if (!state)
+		return;
+
+	log_trace("free state for fd %d", fd);
+	_destroy(state);
+}
+
+/* Once the handshake is done and its buffered app data consumed, the
+ * socket no longer needs to be managed. Called with the lock held.
+ */
+static inline void
+_release_if_done(socket_state_t *state)
+{
+	if (state->hs == CONVERT_HS_DONE && state->rx_off == state->rx_len)
+		_release_state(state);
+}
+
+static void
+_try_release(socket_state_t *state)
+{
+	pthread_mutex_lock(&state->lock);
+	_release_if_done(state);
+	pthread_mutex_unlock(&state->lock);
+}
+
+/* Take the lock of the state. With MSG_DONTWAIT, fails with EAGAIN
+ * rather than wait for the step another thread is in.
+ */
+static int
+_lock(socket_state_t *state, int flags)
+{
+	if (!(flags & MSG_DONTWAIT))
+		pthread_mutex_lock(&state->lock);
+	else if (pthread_mutex_trylock(&state->lock) != 0)
+	{
+		errno = EAGAIN;
+		return -1;
+	}
+	return 0;
+}
+
+/* Serve app data that arrived along with the Convert reply. Called with
+ * the lock held, which is released on return.
+ */
+static ssize_t
+_read_buffered(socket_state_t *state, const struct iovec *iov, int iovcnt,
+			   int flags)
+{
+	size_t avail = state->rx_len - state->rx_off;
+	size_t total = 0;
+	size_t n = 0;
+	int fd = state->fd;
+	ssize_t ret;
+	int i;
+
+	for (i = 0; i < iovcnt; i++)
+	{
+		size_t chunk = iov[i].iov_len < avail - n ? iov[i].iov_len : avail - n;
+
+		memcpy(iov[i].iov_base, state->rx + state->rx_off + n, chunk);
+		n += chunk;
+		total += iov[i].iov_len;
+	}
+
+	if (flags & MSG_PEEK)
+	{
+		pthread_mutex_unlock(&state->lock);
+		return n;
+	}
+
+	state->rx_off += n;
+	_release_if_done(state);
+	pthread_mutex_unlock(&state->lock);
 
-	_free_state(state);
+	if (n == total || !(flags & MSG_WAITALL))
+		return n;
+
+	/* the state may be released already */
+	{
+		struct iovec rest[iovcnt];
+		struct msghdr msg = {.msg_iov = rest};
+		size_t skip = n;
+
+		for (i = 0; i < iovcnt; i++)
+		{
+			if (skip >= iov[i].iov_len)
+			{
+				skip -= iov[i].iov_len;
+				continue;
+			}
+
+			rest[msg.msg_iovlen].iov_base = (uint8_t *)iov[i].iov_base + skip;
+			rest[msg.msg_iovlen++].iov_len = iov[i].iov_len - skip;
+			skip = 0;
+		}
+
+		ret = SYS(recvmsg)(fd, &msg, flags);
+	}
+	return ret < 0 ? (ssize_t)n : (ssize_t)n + ret;
 }
 
 static void
@@ -162,317 +364,1228 @@ _set_no_linger(socket_state_t *state)
 {
 	struct linger linger = {1, 0};
 
-	setsockopt(state->fd, SOL_SOCKET, SO_LINGER, &linger, sizeof(linger));
-}
+	setsockopt(state->fd, SOL_SOCKET, SO_LINGER, &linger, sizeof(linger));
+}
+
+bool
+convert_socket_bound(int fd)
+{
+	struct sockaddr_storage ss;
+	socklen_t len = sizeof(ss);
+
+	if (getsockname(fd, (struct sockaddr *)&ss, &len) < 0)
+		return true;
+
+	switch (ss.ss_family)
+	{
+	case AF_INET:
+	{
+		struct sockaddr_in *in = (struct sockaddr_in *)&ss;
+
+		return in->sin_port || in->sin_addr.s_addr != htonl(INADDR_ANY);
+	}
+	case AF_INET6:
+	{
+		struct sockaddr_in6 *in6 = (struct sockaddr_in6 *)&ss;
+
+		return in6->sin6_port || !IN6_IS_ADDR_UNSPECIFIED(&in6->sin6_addr);
+	}
+	default:
+		return true;
+	}
+}
+
+/* Socket options of the app's socket carried over when its fd is moved
+ * onto another socket.
+ */
+static const struct
+{
+	int level;
+	int name;
+} _moved_sockopts[] = {
+	{SOL_SOCKET, SO_KEEPALIVE},
+	{SOL_SOCKET, SO_LINGER},
+	{SOL_SOCKET, SO_PRIORITY},
+	{SOL_SOCKET, SO_RCVTIMEO},
+	{SOL_SOCKET, SO_SNDTIMEO},
+	{SOL_TCP, TCP_NODELAY},
+};
+
+int
+convert_socket_move(socket_state_t *state, int fd)
+{
+	int fl = fcntl(state->fd, F_GETFL);
+	int fdfl = fcntl(state->fd, F_GETFD);
+	size_t i;
+
+	for (i = 0; i < sizeof(_moved_sockopts) / sizeof(_moved_sockopts[0]); i++)
+	{
+		uint8_t val[sizeof(struct timeval)];
+		socklen_t len = sizeof(val);
+
+		if (getsockopt(state->fd, _moved_sockopts[i].level,
+					   _moved_sockopts[i].name, val, &len) == 0)
+			setsockopt(fd, _moved_sockopts[i].level, _moved_sockopts[i].name,
+					   val, len);
+	}
+
+	if (dup3(fd, state->fd, fdfl > 0 && (fdfl & FD_CLOEXEC) ? O_CLOEXEC : 0) < 0)
+		return -1;
+	SYS(close)(fd);
+
+	if (fl >= 0)
+		fcntl(state->fd, F_SETFL, fl);
+
+	/* options the app did not set are not carried over */
+	convert_policy_tune(state->policy_rule, state->fd);
+
+	convert_epoll_moved(state);
+	return 0;
+}
+
+static bool
+_is_loopback(const struct sockaddr *addr)
+{
+	switch (addr->sa_family)
+	{
+	case AF_INET:
+		return (ntohl(((const struct sockaddr_in *)addr)->sin_addr.s_addr) >>
+				24) == IN_LOOPBACKNET;
+	case AF_INET6:
+	{
+		const struct in6_addr *in6 = &((const struct sockaddr_in6 *)addr)->sin6_addr;
+
+		return IN6_IS_ADDR_LOOPBACK(in6) ||
+			   (IN6_IS_ADDR_V4MAPPED(in6) && in6->s6_addr[12] == IN_LOOPBACKNET);
+	}
+	default:
+		return false;
+	}
+}
+
+/* Create an MPTCP socket in place of the app's TCP one. Returns -1 with
+ * errno set if the kernel refused it for another reason than missing
+ * MPTCP support, and -2 once the upgrade got disabled.
+ */
+static int
+_upgrade_socket(int domain, int type)
+{
+	int fd = SYS(socket)(domain, type, IPPROTO_MPTCP);
+
+	if (fd >= 0)
+		return fd;
+
+	switch (errno)
+	{
+	case EPROTONOSUPPORT:
+	case ENOPROTOOPT:
+	case EINVAL:
+		/* no MPTCP in this kernel, or net.mptcp.enabled is 0 */
+		if (atomic_exchange(&_convert_upgrade_tcp, false))
+			log_warn("MPTCP is not available (%s), leaving TCP sockets "
+					 "alone", strerror(errno));
+		return -2;
+	default:
+		return -1;
+	}
+}
+
+int socket(int domain, int type, int protocol)
+{
+	socket_state_t *state;
+	bool upgraded = false;
+	int fd;
+
+	/* Only consider IPv4/IPv6, SOCK_STREAM, IPPROTO_MPTCP based sockets,
+	 * whatever their SOCK_NONBLOCK and SOCK_CLOEXEC flags, and TCP ones
+	 * too when upgrading them.
+	 */
+	if ((domain != AF_INET && domain != AF_INET6) ||
+		(type & ~(SOCK_NONBLOCK | SOCK_CLOEXEC)) != SOCK_STREAM)
+		return SYS(socket)(domain, type, protocol);
+
+	if ((protocol == 0 || protocol == IPPROTO_TCP) &&
+		atomic_load_explicit(&_convert_upgrade_tcp, memory_order_relaxed))
+	{
+		fd = _upgrade_socket(domain, type);
+		if (fd != -2)
+		{
+			log_trace("socket(%d, %d, %d) upgraded -> fd: %d", domain, type,
+					  protocol, fd);
+			upgraded = true;
+			goto managed;
+		}
+	}
+
+	fd = SYS(socket)(domain, type, protocol);
+	if (protocol != IPPROTO_MPTCP)
+		return fd;
+
+	log_trace("socket(%d, %d, %d) -> fd: %d", domain, type, protocol, fd);
+
+managed:
+	if (fd >= 0 && (state = _alloc(fd)))
+		state->upgraded = upgraded;
+	return fd;
+}
+
+/* Subflows are only created once the connection is MPTCP. A converter
+ * path that does not accept MPTCP with data in the SYN falls back to
+ * plain TCP; in that case stop using fastopen for the next connections
+ * so that they get their subflows again.
+ */
+static void
+_fastopen_check_mptcp(socket_state_t *state)
+{
+	struct mptcp_info info;
+	socklen_t len = sizeof(info);
+	bool fallback;
+
+	memset(&info, 0, sizeof(info));
+
+	/* older kernels reject MPTCP_INFO on fallback sockets */
+	if (getsockopt(state->fd, SOL_MPTCP, MPTCP_INFO, &info, &len) < 0)
+		fallback = errno == EOPNOTSUPP;
+	else
+		fallback = info.mptcpi_flags & MPTCP_INFO_FLAG_FALLBACK;
+
+	if (!fallback)
+		return;
+
+	if (atomic_exchange(&_convert_fastopen, false))
+		log_warn("fd %d fell back to TCP with fastopen, disabling it",
+			   state->fd);
+}
+
+static void
+_handshake_fail(socket_state_t *state, int error)
+{
+	log_warn("[%d] convert handshake failed: %s", state->fd,
+		   strerror(error));
+
+	/* ensure that a RST will be sent to the converter, unless the
+	 * profile asks for a graceful close.
+	 */
+	if (convert_policy_abort_on_error(state->policy_rule))
+		_set_no_linger(state);
+
+	/* the converter path to this destination may no longer be the best */
+	convert_race_forget((struct sockaddr *)&state->dest);
+	convert_policy_failed(state->policy_rule);
+
+	convert_stat_inc(CONVERT_STAT_HS_FAILURES);
+
+	state->hs = CONVERT_HS_ERROR;
+	state->error = error;
+	errno = error;
+}
+
+/* Start the connection to the converter. Returns 0 once the connection
+ * is established or in progress, -1 with errno set otherwise.
+ */
+static int
+_connect_converter(socket_state_t *state)
+{
+	const struct sockaddr *addr;
+	socklen_t addrlen;
+
+	addr = convert_endpoint_addr(state->endpoint, &addrlen);
+	state->connect_start_us = _now_us();
+	if (SYS(connect)(state->fd, addr, addrlen) < 0)
+	{
+		if (errno != EINPROGRESS)
+			return -1;
+
+		log_debug("redirection of fd %d in progress", state->fd);
+		state->hs = CONVERT_HS_CONNECTING;
+		return 0;
+	}
+
+	convert_stat_time(CONVERT_HIST_CONNECT, _now_us() - state->connect_start_us);
+	state->hs = CONVERT_HS_SEND_HDR;
+	return 0;
+}
+
+/* Move the socket to the next converter endpoint not tried yet by this
+ * connect. Not possible once app data went through the failed one.
+ * Returns -1 if no endpoint is left.
+ */
+static int
+_failover(socket_state_t *state)
+{
+	int next;
+
+	if (state->app_sent)
+		return -1;
+
+	while ((next = convert_endpoint_pick(state->endpoints_tried)) >= 0)
+	{
+		const struct sockaddr *addr;
+		socklen_t addrlen;
+		int fd;
+
+		state->endpoints_tried |= 1u << next;
+		convert_endpoint_put(state->endpoint);
+		state->endpoint = next;
+
+		addr = convert_endpoint_addr(next, &addrlen);
+		fd = SYS(socket)(addr->sa_family, SOCK_STREAM | SOCK_CLOEXEC,
+						 IPPROTO_MPTCP);
+		if (fd < 0 || convert_socket_move(state, fd) < 0)
+		{
+			if (fd >= 0)
+				SYS(close)(fd);
+			return -1;
+		}
+
+		log_warn("fd %d fails over to converter %s", state->fd,
+			   convert_endpoint_name(next));
+		convert_stat_inc(CONVERT_STAT_FAILOVERS);
+
+		state->hs = CONVERT_HS_IDLE;
+		state->tx_off = 0;
+		state->rx_len = 0;
+		state->rx_need = 0;
+		state->rx_off = 0;
+		state->syn_pending = false;
+		state->fastopen = false;
+
+		if (_connect_converter(state) == 0)
+			return 0;
+
+		convert_endpoint_failure(next);
+	}
+
+	return -1;
+}
+
+/* The converter endpoint itself failed, as opposed to the destination
+ * behind it: account for it and fail over. Returns 0 if the handshake
+ * goes on with another endpoint.
+ */
+static int
+_endpoint_fail(socket_state_t *state, int error)
+{
+	convert_endpoint_failure(state->endpoint);
+
+	if (_failover(state) == 0)
+		return 0;
+
+	_handshake_fail(state, error);
+	return -1;
+}
+
+static int
+_handshake_connecting(socket_state_t *state)
+{
+	struct pollfd pfd = {.fd = state->fd, .events = POLLOUT};
+	socklen_t len = sizeof(int);
+	int error = 0;
+
+	if (SYS(poll)(&pfd, 1, 0) < 0)
+		return -1;
+
+	if (!(pfd.revents & (POLLOUT | POLLERR | POLLHUP)))
+	{
+		errno = EAGAIN;
+		return -1;
+	}
+
+	if (getsockopt(state->fd, SOL_SOCKET, SO_ERROR, &error, &len) < 0)
+		error = errno;
+
+	if (error)
+		return _endpoint_fail(state, error);
+
+	convert_stat_time(CONVERT_HIST_CONNECT, _now_us() - state->connect_start_us);
+	state->hs = CONVERT_HS_SEND_HDR;
+	return 0;
+}
+
+/* Send the rest of the Convert message followed by the app data in iov,
+ * as a single sendmsg() so that they share a segment. With syn_pending,
+ * this also opens the connection and both ride in the SYN. Returns the
+ * number of app bytes sent, which is 0 while the message is incomplete,
+ * or -1 with errno set.
+ */
+static ssize_t
+_send_hdr(socket_state_t *state, const struct iovec *iov, int iovcnt,
+		  int flags)
+{
+	struct iovec vec[1 + iovcnt];
+	struct msghdr msg = {
+		.msg_iov = vec,
+		.msg_iovlen = 1 + iovcnt,
+	};
+	size_t left = state->tx_len - state->tx_off;
+	ssize_t ret;
+
+	vec[0].iov_base = state->tx + state->tx_off;
+	vec[0].iov_len = left;
+	if (iovcnt)
+		memcpy(&vec[1], iov, iovcnt * sizeof(*iov));
+
+	if (state->syn_pending)
+	{
+		socklen_t addrlen;
+
+		msg.msg_name = (void *)convert_endpoint_addr(state->endpoint, &addrlen);
+		msg.msg_namelen = addrlen;
+		flags |= MSG_FASTOPEN;
+	}
+
+	ret = SYS(sendmsg)(state->fd, &msg, flags | MSG_NOSIGNAL);
+	if (ret < 0 && state->syn_pending)
+	{
+		state->syn_pending = false;
+
+		switch (errno)
+		{
+		case EINPROGRESS:
+			/* non-blocking SYN sent without data */
+			state->hs = CONVERT_HS_CONNECTING;
+			errno = EAGAIN;
+			return -1;
+		case EOPNOTSUPP:
+			log_warn("fastopen not supported on fd %d, disabling it",
+				   state->fd);
+			atomic_store(&_convert_fastopen, false);
+
+			if (_connect_converter(state) < 0)
+				break;
+			errno = EAGAIN;
+			return state->hs == CONVERT_HS_SEND_HDR
+					   ? _send_hdr(state, iov, iovcnt, flags & ~MSG_FASTOPEN)
+					   : -1;
+		}
+	}
+
+	if (ret < 0)
+	{
+		if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR &&
+			_endpoint_fail(state, errno) == 0)
+			/* nothing sent yet on the next endpoint */
+			return 0;
+		return -1;
+	}
+
+	if (state->syn_pending)
+	{
+		state->syn_pending = false;
+		state->fastopen = true;
+	}
+
+	if ((size_t)ret < left)
+	{
+		state->tx_off += ret;
+		return 0;
+	}
+
+	state->tx_off = state->tx_len;
+	state->hdr_sent_us = _now_us();
+	state->hs = CONVERT_HS_WAIT_REPLY;
+	if ((size_t)ret > left)
+		state->app_sent = true;
+	return ret - left;
+}
+
+static int
+_handshake_read_reply(socket_state_t *state)
+{
+	struct convert_opts_view opts;
+	size_t length;
+	ssize_t ret;
+	long now;
+
+	/* A single read for the whole reply. App data that arrived behind
+	 * it is kept in rx and served first by the next reads. It never
+	 * blocks: convert_handshake() waits for the reply without the lock.
+	 */
+	ret = SYS(recv)(state->fd, state->rx + state->rx_len,
+					sizeof(state->rx) - state->rx_len, MSG_DONTWAIT);
+	if (ret == 0)
+	{
+		/* the converter closes the connection when it is unable to
+		 * reach the destination.
+		 */
+		_handshake_fail(state, ECONNREFUSED);
+		return -1;
+	}
+	if (ret < 0)
+	{
+		if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR &&
+			_endpoint_fail(state, errno) == 0)
+			return 0;
+		return -1;
+	}
+
+	state->rx_len += ret;
+
+	if (!state->rx_need && state->rx_len >= CONVERT_HDR_LEN)
+	{
+		if (convert_parse_header(state->rx, CONVERT_HDR_LEN, &length) < 0)
+		{
+			log_error("[%d] unable to read the convert header",
+				   state->fd);
+			_handshake_fail(state, ECONNREFUSED);
+			return -1;
+		}
+
+		state->rx_need = CONVERT_HDR_LEN + length;
+	}
+
+	if (!state->rx_need || state->rx_len < state->rx_need)
+		return 0;
+
+	/* the endpoint answered, whatever the outcome for the destination */
+	now = _now_us();
+	convert_endpoint_success(state->endpoint, now - state->hs_start_us);
+	/* with fastopen, this includes the connection to the converter */
+	convert_stat_time(CONVERT_HIST_REPLY, now - state->hdr_sent_us);
+
+	if (state->rx_need > CONVERT_HDR_LEN)
+	{
+		if (convert_parse_tlvs_view(state->rx + CONVERT_HDR_LEN,
+									state->rx_need - CONVERT_HDR_LEN,
+									&opts) < 0)
+		{
+			log_error("[%d] unable to parse the convert tlvs",
+				   state->fd);
+			_handshake_fail(state, ECONNREFUSED);
+			return -1;
+		}
+
+		/* if we receive the TLV error we need to inform the app */
+		if (opts.flags & CONVERT_F_ERROR)
+		{
+			log_info("received TLV error: %u", opts.error_code);
+			convert_stat_error(opts.error_code);
+			/* not to send them to this converter again */
+			if (opts.error_code == CONVERT_ERROR_UNSUPPORTED_TCP_OPT)
+				convert_endpoint_unsupported(state->endpoint, opts.error_value,
+											 opts.error_value_len);
+			_handshake_fail(state, convert_error_to_errno(opts.error_code));
+			return -1;
+		}
+	}
+
+	state->rx_off = state->rx_need;
+	state->hs = CONVERT_HS_DONE;
+
+	if (state->fastopen)
+		_fastopen_check_mptcp(state);
+
+	return 0;
+}
+
+/* Drive the handshake until it reaches the state `until`, with the lock
+ * held. The reply is read without blocking, other steps follow the
+ * blocking mode of the socket, unless flags carries MSG_DONTWAIT.
+ * Returns 0 once `until` is reached, or -1 with errno set: EAGAIN when
+ * the step would block, the handshake error otherwise.
+ */
+static int
+_handshake(socket_state_t *state, int until, int flags)
+{
+	int hs = state->hs;
+	int ret = 0;
+
+	flags &= MSG_DONTWAIT;
+
+	while (ret == 0 && state->hs < until)
+	{
+		switch (state->hs)
+		{
+		case CONVERT_HS_CONNECTING:
+			ret = _handshake_connecting(state);
+			break;
+		case CONVERT_HS_SEND_HDR:
+			ret = _send_hdr(state, NULL, 0, flags) < 0 ? -1 : 0;
+			break;
+		case CONVERT_HS_WAIT_REPLY:
+			ret = _handshake_read_reply(state);
+			break;
+		case CONVERT_HS_ERROR:
+			errno = state->error;
+			return -1;
+		default:
+			errno = ENOTCONN;
+			return -1;
+		}
+	}
+
+	if (ret == 0 && state->hs == CONVERT_HS_ERROR)
+	{
+		errno = state->error;
+		return -1;
+	}
+
+	if (ret < 0 && errno == EWOULDBLOCK)
+		errno = EAGAIN;
+
+	if (state->hs != hs && state->ep_fd >= 0)
+	{
+		int err = errno;
+
+		convert_epoll_sync(state);
+		errno = err;
+	}
+
+	return ret;
+}
+
+int
+convert_handshake(socket_state_t *state, int until, int flags)
+{
+	int ret;
+
+	flags &= MSG_DONTWAIT;
+
+	if (_lock(state, flags) < 0)
+		return -1;
+
+	while ((ret = _handshake(state, until, flags)) < 0 && errno == EAGAIN &&
+		   !flags && state->hs == CONVERT_HS_WAIT_REPLY)
+	{
+		char c;
+
+		/* wait for the reply without the lock, so that other threads
+		 * can write meanwhile. The peek blocks as the app's call would
+		 * have, SO_RCVTIMEO included.
+		 */
+		pthread_mutex_unlock(&state->lock);
+		if (SYS(recv)(state->fd, &c, 1, MSG_PEEK) < 0 &&
+			(errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR))
+		{
+			if (errno == EWOULDBLOCK)
+				errno = EAGAIN;
+			return -1;
+		}
+		pthread_mutex_lock(&state->lock);
+	}
+
+	pthread_mutex_unlock(&state->lock);
+	return ret;
+}
+
+/* Open the path to the converter for the CONNECT TLV in tx: a pooled
+ * connection, a SYN carrying the TLV with fastopen, or a regular connect.
+ * Returns -1 with errno set if the converter cannot be used.
+ */
+static int
+_start(socket_state_t *state)
+{
+	state->hs_start_us = _now_us();
+
+	if (convert_pool_take(state) == 0)
+	{
+		/* already connected, only the CONNECT TLV is left to send */
+		state->endpoints_tried = 1u << state->endpoint;
+		state->hs = CONVERT_HS_SEND_HDR;
+		convert_stat_inc(CONVERT_STAT_POOLED);
+		return 0;
+	}
+
+	state->endpoint = convert_endpoint_pick(0);
+	if (state->endpoint < 0)
+	{
+		/* all retired since the resolution: connect directly */
+		errno = EHOSTUNREACH;
+		return -1;
+	}
+	state->endpoints_tried = 1u << state->endpoint;
+
+	/* the converter's INFO reply may have ruled fastopen out */
+	if (atomic_load_explicit(&_convert_fastopen, memory_order_relaxed) &&
+		convert_endpoint_supports(state->endpoint, CONVERT_TCPOPT_FASTOPEN))
+	{
+		state->syn_pending = true;
+		state->hs = CONVERT_HS_SEND_HDR;
+
+		/* the SYN leaves with the first write */
+		if (!_convert_pipeline && _send_hdr(state, NULL, 0, 0) < 0 &&
+			state->hs == CONVERT_HS_ERROR)
+			return -1;
+		return 0;
+	}
+
+	if (_connect_converter(state) < 0)
+	{
+		int err = errno;
+
+		log_warn("connect to converter %s failed: %s",
+			   convert_endpoint_name(state->endpoint), strerror(errno));
+		convert_endpoint_failure(state->endpoint);
+
+		if (_failover(state) < 0)
+		{
+			errno = err;
+			return -1;
+		}
+	}
+	return 0;
+}
+
+int
+convert_start(socket_state_t *state)
+{
+	int ret;
+
+	if (convert_endpoints_resolve() < 0)
+	{
+		errno = EHOSTUNREACH;
+		return -1;
+	}
+
+	pthread_mutex_lock(&state->lock);
+	ret = _start(state);
+	pthread_mutex_unlock(&state->lock);
+	return ret;
+}
+
+int
+convert_connect_until(void)
+{
+	if (_convert_pipeline)
+		return CONVERT_HS_SEND_HDR;
+	if (_convert_optimistic)
+		return CONVERT_HS_WAIT_REPLY;
+	return CONVERT_HS_DONE;
+}
+
+static int _validate_config();
+
+static void
+_setup(void)
+{
+	if (_validate_config() < 0)
+	{
+		log_error("setup failed, connecting without the converter");
+		/* the log may be off: the app must learn why */
+		fprintf(stderr, "convert: unable to setup connection interception, "
+						"see CONVERT_LOG for details.\n");
+		return;
+	}
+
+	_convert_ready = true;
+	log_debug("setup done");
+}
+
+int connect(int sockfd, const struct sockaddr *addr, socklen_t addrlen)
+{
+	int path = CONVERT_PATH_UNKNOWN;
+	socket_state_t *state;
+	int policy;
+	ssize_t len;
+	int ret;
+
+	state = convert_lookup(sockfd);
+
+	// if the socket is not managed by the library, just call the original
+	// connect() syscall
+	if (!state)
+		return SYS(connect)(sockfd, addr, addrlen);
+
+	/* connect() again while a non-blocking handshake is ongoing */
+	if (state->hs != CONVERT_HS_IDLE)
+	{
+		if (convert_handshake(state, convert_connect_until(), MSG_DONTWAIT) == 0)
+		{
+			_try_release(state);
+			errno = EISCONN;
+		}
+		else if (errno == EAGAIN)
+			errno = EALREADY;
+		return -1;
+	}
+
+	pthread_once(&_setup_once, _setup);
+	if (!_convert_ready)
+		goto error;
+
+	/* a TCP app talking to a local service did not ask for multipath */
+	if (state->upgraded && _is_loopback(addr))
+	{
+		log_debug("fd %d connects directly to a local address", sockfd);
+		goto direct;
+	}
+
+	policy = convert_policy_lookup(addr, &state->policy_rule);
+	convert_policy_tune(state->policy_rule, sockfd);
+
+	if (policy == CONVERT_POLICY_DIRECT)
+	{
+		log_debug("fd %d connects directly by policy", sockfd);
+		goto direct;
+	}
+
+	log_debug("redirecting fd %d", sockfd);
+
+	/* only the destination changes from one CONNECT TLV to the next */
+	len = convert_template_write(&_connect_template, state->tx,
+								 sizeof(state->tx), addr);
+	if (len < 0)
+	{
+		log_debug("fd %d specified an invalid address family %d", sockfd,
+			   addr->sa_family);
+		goto error;
+	}
+
+	state->tx_len = len;
+	memcpy(&state->dest, addr, addrlen < sizeof(state->dest) ? addrlen : sizeof(state->dest));
+
+	path = convert_race_lookup(addr);
+	if (path == CONVERT_PATH_DIRECT)
+	{
+		log_debug("fd %d connects directly to a known destination", sockfd);
+		convert_stat_inc(CONVERT_STAT_DIRECT);
+		goto error;
+	}
+
+	convert_stat_inc(CONVERT_STAT_REDIRECTS);
+
+	if (path == CONVERT_PATH_UNKNOWN && convert_race_wanted(state))
+	{
+		path = convert_race_connect(state, addr, addrlen);
+		if (path == CONVERT_PATH_DIRECT)
+		{
+			convert_stat_inc(CONVERT_STAT_DIRECT);
+			_release_state(state);
+		}
+		else if (path == CONVERT_PATH_CONVERTER)
+			_try_release(state);
+		return path < 0 ? -1 : 0;
+	}
+
+	if (convert_start(state) < 0)
+	{
+		convert_policy_failed(state->policy_rule);
+		goto error;
+	}
+
+	/* the app may have registered the socket before connecting it */
+	if (state->ep_fd >= 0)
+	{
+		pthread_mutex_lock(&state->lock);
+		convert_epoll_sync(state);
+		pthread_mutex_unlock(&state->lock);
+	}
+
+	if (state->syn_pending)
+		return 0;
+
+	if (state->hs == CONVERT_HS_CONNECTING)
+	{
+		errno = EINPROGRESS;
+		return -1;
+	}
+
+	if (convert_handshake(state, convert_connect_until(), 0) == 0)
+	{
+		_try_release(state);
+		return 0;
+	}
+
+	/* the reply (or the rest of the header) follows asynchronously */
+	if (errno == EAGAIN)
+		errno = EINPROGRESS;
+	return -1;
+
+	/* If the redirection failed during the connect() there are no benefit to
+	 * keep the allocated state. Clear it and behave like we never handled
+	 * that file descriptor.
+	 */
+error:
+	if (path != CONVERT_PATH_DIRECT)
+		convert_stat_inc(CONVERT_STAT_FALLBACKS);
+direct:
+	_release_state(state);
+	ret = SYS(connect)(sockfd, addr, addrlen);
+
+	/* the cached direct path no longer works: race again next time */
+	if (ret < 0 && path == CONVERT_PATH_DIRECT && errno != EINPROGRESS)
+	{
+		int err = errno;
+
+		convert_race_forget(addr);
+		errno = err;
+	}
+	return ret;
+}
+
+int close(int sockfd)
+{
+	/* free any state created. */
+	_free(sockfd);
+
+	return SYS(close)(sockfd);
+}
+
+/* Data path.
+ *
+ * Writes first complete the Convert message: while it is incomplete,
+ * the app data goes out with it in a single sendmsg(). Zero-copy and
+ * control data cannot share that call: the message is then flushed on
+ * its own with MSG_MORE and the app's call follows unchanged. Reads
+ * first complete the handshake and serve the app data that came with
+ * the reply. The socket is left alone once that is done.
+ */
+
+/* Send the Convert message ahead of the app data in iov, or alone with
+ * MSG_MORE if iov is NULL. Returns the number of app bytes sent along,
+ * 0 when the caller still has to send them, or -1 with errno set.
+ */
+static ssize_t
+_write_prepare(socket_state_t *state, const struct iovec *iov, int iovcnt,
+			   int flags)
+{
+	ssize_t ret = 0;
+
+	if (_lock(state, flags) < 0)
+		return -1;
+
+	/* a failover starts over from a new connection */
+	for (;;)
+	{
+		if (_handshake(state, CONVERT_HS_SEND_HDR, flags) < 0)
+		{
+			ret = -1;
+			goto out;
+		}
+
+		if (state->hs != CONVERT_HS_SEND_HDR)
+			break;
+
+		ret = _send_hdr(state, iov, iov ? iovcnt : 0,
+						iov ? flags : flags | MSG_MORE);
+		if (ret < 0 || (ret > 0 && iov))
+			goto out;
+	}
+
+	/* written ahead of the reply: the endpoint can no longer change */
+	if (state->hs == CONVERT_HS_WAIT_REPLY)
+		state->app_sent = true;
+	ret = 0;
+
+out:
+	pthread_mutex_unlock(&state->lock);
+	return ret;
+}
+
+/* Complete the handshake before a read. Returns 1, with the lock held,
+ * when app data that came with the reply is to be served first, 0 when
+ * the caller reads from the socket, or -1 with errno set.
+ */
+static int
+_read_prepare(socket_state_t *state, int flags)
+{
+	if (convert_handshake(state, CONVERT_HS_DONE, flags) < 0)
+		return -1;
+
+	pthread_mutex_lock(&state->lock);
+	if (state->rx_off < state->rx_len)
+		return 1;
 
-static void
-_to_v4mapped(in_addr_t from, struct in6_addr *to)
-{
-	*to = (struct in6_addr){
-		.s6_addr32 = {
-			0,
-			0,
-			htonl(0xffff),
-			from,
-		},
-	};
+	_release_state(state);
+	pthread_mutex_unlock(&state->lock);
+	return 0;
 }
 
-static ssize_t
-_redirect_connect_tlv(uint8_t *buf, size_t buf_len, struct sockaddr *addr)
+ssize_t
+recv(int sockfd, void *buf, size_t len, int flags)
 {
-	ssize_t ret;
-	struct convert_opts opts = {0};
+	struct iovec iov = {.iov_base = buf, .iov_len = len};
+	socket_state_t *state;
+	int ret;
 
-	opts.flags = CONVERT_F_CONNECT;
+	state = convert_lookup(sockfd);
+	if (!state)
+		return SYS(recv)(sockfd, buf, len, flags);
 
-	if (_convert_cookie)
-	{
-		opts.flags |= CONVERT_F_COOKIE;
-		opts.cookie_len = strlen(_convert_cookie);
-		opts.cookie_data = (uint8_t *)_convert_cookie;
-	}
+	ret = _read_prepare(state, flags);
+	if (ret != 0)
+		return ret < 0 ? -1 : _read_buffered(state, &iov, 1, flags);
 
-	switch (addr->sa_family)
-	{
-	case AF_INET:
-	{
-		struct sockaddr_in *in = (struct sockaddr_in *)addr;
+	return SYS(recv)(sockfd, buf, len, flags);
+}
 
-		/* already in network bytes */
-		_to_v4mapped(in->sin_addr.s_addr, &opts.remote_addr.sin6_addr);
-		opts.remote_addr.sin6_port = in->sin_port;
-		break;
-	}
-	case AF_INET6:
-	{
-		struct sockaddr_in6 *in6 = (struct sockaddr_in6 *)addr;
+ssize_t
+recvfrom(int sockfd, void *buf, size_t len, int flags,
+		 struct sockaddr *src_addr, socklen_t *addrlen)
+{
+	struct iovec iov = {.iov_base = buf, .iov_len = len};
+	socket_state_t *state;
+	int ret;
 
-		/* already in network bytes */
-		memcpy(&opts.remote_addr, in6, sizeof(opts.remote_addr));
-		break;
-	}
-	default:
-		return -EAFNOSUPPORT;
-	}
+	state = convert_lookup(sockfd);
+	if (!state)
+		return SYS(recvfrom)(sockfd, buf, len, flags, src_addr, addrlen);
 
-	ret = convert_write(buf, buf_len, &opts);
+	ret = _read_prepare(state, flags);
 	if (ret < 0)
-	{
-		printf("unable to allocate the convert header\n");
-		ret = -EOPNOTSUPP;
-	}
-	return ret;
+		return -1;
+	if (ret == 0)
+		return SYS(recvfrom)(sockfd, buf, len, flags, src_addr, addrlen);
+
+	/* as for any TCP socket, no source address */
+	if (src_addr && addrlen)
+		*addrlen = 0;
+	return _read_buffered(state, &iov, 1, flags);
 }
 
-static int
-_redirect(socket_state_t *state, struct sockaddr *dest)
+ssize_t
+recvmsg(int sockfd, struct msghdr *msg, int flags)
 {
-	uint8_t buf[1024];
-	ssize_t len;
-
-	len = _redirect_connect_tlv(buf, sizeof(buf), dest);
-
-	if (len < 0)
-		return len;
+	socket_state_t *state;
+	int ret;
 
-	// // use TCP fast open to send the convert header in the SYN packet
-	// return sendto(state->fd, buf, len, MSG_FASTOPEN, _converter_addr->ai_addr,
-	// 			  _converter_addr->ai_addrlen);
+	state = convert_lookup(sockfd);
+	if (!state)
+		return SYS(recvmsg)(sockfd, msg, flags);
 
-	// Fast Open interferes with creating subflows
-	int (*lconnect)(int, const struct sockaddr *, socklen_t) = dlsym(RTLD_NEXT, "connect");
-	if (lconnect(state->fd, _converter_addr->ai_addr, _converter_addr->ai_addrlen) < 0)
-	{
-		printf("connect to converter failed: %s\n", strerror(errno));
+	ret = _read_prepare(state, flags);
+	if (ret < 0)
 		return -1;
-	}
-	// send the convert header
-	int (*lsend)(int, const void *, size_t, int) = dlsym(RTLD_NEXT, "send");
-	return lsend(state->fd, buf, len, 0);
+	if (ret == 0)
+		return SYS(recvmsg)(sockfd, msg, flags);
+
+	msg->msg_namelen = 0;
+	msg->msg_controllen = 0;
+	msg->msg_flags = 0;
+	return _read_buffered(state, msg->msg_iov, msg->msg_iovlen, flags);
 }
 
-int socket(int domain, int type, int protocol)
+ssize_t
+read(int fd, void *buf, size_t count)
 {
-	printf("socket intercept\n");
-	/* Execute the socket() syscall to learn the file descriptor.
-	 * Transform the domain to IPv4 or IPv6 depending on the
-	 * Converter address family (address families of end-server
-	 * and of Converter don't have to match).
-	 */
-	int (*lsocket)(int, int, int) = dlsym(RTLD_NEXT, "socket");
-	int fd = lsocket(domain, type, protocol);
-	/* Only consider IPv4/IPv6, SOCK_STREAM, IPPROTO_MPTCP based sockets. */
-	if ((domain == AF_INET || domain == AF_INET6) && type == SOCK_STREAM && protocol == IPPROTO_MPTCP)
-	{
-		printf("socket(%d, %d, %d)\n", domain, type, protocol);
-		printf("-> fd: %d\n", fd);
+	struct iovec iov = {.iov_base = buf, .iov_len = count};
+	socket_state_t *state;
+	int ret;
 
-		if (fd >= 0)
-			_alloc(fd);
-	}
-	return fd;
-}
+	state = convert_lookup(fd);
+	if (!state)
+		return SYS(read)(fd, buf, count);
 
-#define CONVERT_HDR_LEN sizeof(struct convert_header)
+	ret = _read_prepare(state, 0);
+	if (ret != 0)
+		return ret < 0 ? -1 : _read_buffered(state, &iov, 1, 0);
 
-static int
-_read_convert(socket_state_t *state, bool peek, int fail_errno)
+	return SYS(read)(fd, buf, count);
+}
+
+ssize_t
+readv(int fd, const struct iovec *iov, int iovcnt)
 {
-	uint8_t hdr[CONVERT_HDR_LEN];
+	socket_state_t *state;
 	int ret;
-	int flag = peek ? MSG_PEEK : 0;
-	size_t length;
-	size_t offset = peek ? CONVERT_HDR_LEN : 0;
-	struct convert_opts *opts;
-
-	printf("peek fd %d to see whether data is in the receive "
-		   "queue\n",
-		   state->fd);
 
-	ret = recvfrom(state->fd, hdr, CONVERT_HDR_LEN, MSG_WAITALL | flag, NULL, NULL);
+	state = convert_lookup(fd);
+	if (!state)
+		return SYS(readv)(fd, iov, iovcnt);
 
-	printf("peek returned %d\n", ret);
-	if (ret < 0)
-	{
-		printf("[%d] unable to peek the convert header\n",
-			   state->fd);
-		/* In case of error we want to skip the actual call.
-		 * Moreover, if return EAGAIN (non-blocking) we don't
-		 * want to app to receive the buffer.
-		 */
-		goto skip;
-	}
+	ret = _read_prepare(state, 0);
+	if (ret != 0)
+		return ret < 0 ? -1 : _read_buffered(state, iov, iovcnt, 0);
 
-	if (convert_parse_header(hdr, ret, &length) < 0)
-	{
-		printf("[%d] unable to read the convert header\n",
-			   state->fd);
-		goto error;
-	}
+	return SYS(readv)(fd, iov, iovcnt);
+}
 
-	if (length)
-	{
-		printf("convert header indicates %zu bytes of data\n",
-			   length);
-		uint8_t buffer[length + offset];
+/* _FORTIFY_SOURCE builds call these, which reach the kernel without
+ * going through the functions above.
+ */
+extern void __chk_fail(void) __attribute__((noreturn));
 
-		/* if peek the data was not yet read, so we need to
-		 * also read (again the main header). */
-		if (peek)
-			length += CONVERT_HDR_LEN;
+ssize_t
+__read_chk(int fd, void *buf, size_t count, size_t buflen)
+{
+	if (count > buflen)
+		__chk_fail();
+	return read(fd, buf, count);
+}
 
-		ret = recvfrom(state->fd, buffer, length, MSG_WAITALL, NULL, NULL);
-		if (ret != (int)length || ret < 0)
-		{
-			printf("[%d] unable to read the convert"
-				   " tlvs\n",
-				   state->fd);
-			goto error;
-		}
+ssize_t
+__recv_chk(int sockfd, void *buf, size_t len, size_t buflen, int flags)
+{
+	if (len > buflen)
+		__chk_fail();
+	return recv(sockfd, buf, len, flags);
+}
 
-		opts = convert_parse_tlvs(buffer + offset, length - offset);
-		if (opts == NULL) {
-			printf("[%d] unable to parse the convert tlvs\n",
-				   state->fd);
-			goto error;
-		}
+ssize_t
+__recvfrom_chk(int sockfd, void *buf, size_t len, size_t buflen, int flags,
+			   struct sockaddr *src_addr, socklen_t *addrlen)
+{
+	if (len > buflen)
+		__chk_fail();
+	return recvfrom(sockfd, buf, len, flags, src_addr, addrlen);
+}
 
-		/* if we receive the TLV error we need to inform the app */
-		if (opts->flags & CONVERT_F_ERROR)
-		{
-			printf("received TLV error: %u\n", opts->error_code);
-			goto error_and_free;
-		}
-	}
+ssize_t
+send(int sockfd, const void *buf, size_t len, int flags)
+{
+	struct iovec iov = {.iov_base = (void *)buf, .iov_len = len};
+	socket_state_t *state;
+	ssize_t ret;
 
-	/* everything was fine : free the state */
-	if (!peek)
-		_free_state(state);
+	state = convert_lookup(sockfd);
+	/* not connected yet: let the kernel answer */
+	if (!state || state->hs == CONVERT_HS_IDLE)
+		return SYS(send)(sockfd, buf, len, flags);
 
-	printf("return run\n");
-	return SYSCALL_RUN;
+	ret = _write_prepare(state, &iov, 1, flags);
+	if (ret != 0)
+		return ret;
 
-error_and_free:
-	printf("return error and free\n");
-	convert_free_opts(opts);
+	return SYS(send)(sockfd, buf, len, flags);
+}
 
-error:
-	printf("return error: -%d\n", fail_errno);
+ssize_t
+sendto(int sockfd, const void *buf, size_t len, int flags,
+	   const struct sockaddr *dest_addr, socklen_t addrlen)
+{
+	struct iovec iov = {.iov_base = (void *)buf, .iov_len = len};
+	socket_state_t *state;
+	ssize_t ret;
 
-	/* ensure that a RST will be sent to the converter. */
-	_set_no_linger(state);
+	state = convert_lookup(sockfd);
+	if (!state || state->hs == CONVERT_HS_IDLE)
+		return SYS(sendto)(sockfd, buf, len, flags, dest_addr, addrlen);
 
-	if (!peek)
-		_free_state(state);
+	ret = _write_prepare(state, &iov, 1, flags);
+	if (ret != 0)
+		return ret;
 
-skip:
-	printf("skip the syscall\n");
-	return SYSCALL_SKIP;
+	return SYS(sendto)(sockfd, buf, len, flags, dest_addr, addrlen);
 }
 
-int connect(int sockfd, const struct sockaddr *addr, socklen_t addrlen)
+ssize_t
+sendmsg(int sockfd, const struct msghdr *msg, int flags)
 {
-	int (*lconnect)(int, const struct sockaddr *, socklen_t) = dlsym(RTLD_NEXT, "connect");
 	socket_state_t *state;
-	int result;
+	ssize_t ret;
 
-	state = _lookup(sockfd);
+	state = convert_lookup(sockfd);
+	if (!state || state->hs == CONVERT_HS_IDLE)
+		return SYS(sendmsg)(sockfd, msg, flags);
 
-	// if the socket is not managed by the library, just call the original
-	// connect() syscall
-	if (!state)
-		return lconnect(sockfd, addr, addrlen);
+	if ((flags & MSG_ZEROCOPY) || msg->msg_controllen)
+		ret = _write_prepare(state, NULL, 0, flags & MSG_DONTWAIT);
+	else
+		ret = _write_prepare(state, msg->msg_iov, msg->msg_iovlen, flags);
+	if (ret != 0)
+		return ret;
 
-	printf("redirecting fd %d\n", sockfd);
+	return SYS(sendmsg)(sockfd, msg, flags);
+}
 
-	switch (addr->sa_family)
-	{
-	case AF_INET:
-	case AF_INET6:
-		result = _redirect(state, (struct sockaddr *)addr);
-		break;
-	default:
-		printf("fd %d specified an invalid address family %d\n", sockfd,
-			   addr->sa_family);
-		goto error;
-	}
+ssize_t
+write(int fd, const void *buf, size_t count)
+{
+	struct iovec iov = {.iov_base = (void *)buf, .iov_len = count};
+	socket_state_t *state;
+	ssize_t ret;
 
-	if (result >= 0)
-	{
-		printf("redirection of fd %d in progress: %d\n", sockfd, result);
+	state = convert_lookup(fd);
+	if (!state || state->hs == CONVERT_HS_IDLE)
+		return SYS(write)(fd, buf, count);
 
-		/* If the sendto succeeded the received queue can be peeked to
-		 * check
-		 * the answer from the converter. */
-		if (result > 0)
-			return _read_convert(state, false, ECONNREFUSED);
+	ret = _write_prepare(state, &iov, 1, 0);
+	if (ret != 0)
+		return ret;
 
-		return -ECONNREFUSED;
-	}
+	return SYS(write)(fd, buf, count);
+}
 
-	printf("the redirection of fd %d failed with error: %d\n", sockfd, result);
-	printf("errno: %d\n", errno);
-	printf("error: %s\n", strerror(errno));
+ssize_t
+writev(int fd, const struct iovec *iov, int iovcnt)
+{
+	socket_state_t *state;
+	ssize_t ret;
 
-	/* If the redirection failed during the connect() there are no benefit to
-	 * keep the allocated state. Clear it and behave like we never handled
-	 * that file descriptor.
-	 */
-error:
-	_free_state(state);
-	return lconnect(sockfd, addr, addrlen);
+	state = convert_lookup(fd);
+	if (!state || state->hs == CONVERT_HS_IDLE)
+		return SYS(writev)(fd, iov, iovcnt);
+
+	ret = _write_prepare(state, iov, iovcnt, 0);
+	if (ret != 0)
+		return ret;
+
+	return SYS(writev)(fd, iov, iovcnt);
 }
 
-int close(int sockfd)
+ssize_t
+sendfile(int out_fd, int in_fd, off_t *offset, size_t count)
 {
-	/* free any state created. */
-	_free(sockfd);
-	int (*lclose)(int) = dlsym(RTLD_NEXT, "close");
+	socket_state_t *state;
 
-	return lclose(sockfd);
+	state = convert_lookup(out_fd);
+	if (state && state->hs != CONVERT_HS_IDLE &&
+		_write_prepare(state, NULL, 0, 0) < 0)
+		return -1;
+
+	return SYS(sendfile)(out_fd, in_fd, offset, count);
 }
 
 ssize_t
-recv(int sockfd, void *buf, size_t len, int flags)
+sendfile64(int out_fd, int in_fd, off64_t *offset, size_t count)
 {
 	socket_state_t *state;
-	ssize_t (*lrecv)(int, void *, size_t, int) = dlsym(RTLD_NEXT, "recv");
-
-	state = _lookup(sockfd);
-	if (!state)
-		return lrecv(sockfd, buf, len, flags);
 
-	switch (_read_convert(state, false, ECONNREFUSED))
-	{
-	case SYSCALL_RUN:
-		return lrecv(sockfd, buf, len, flags);
-	case SYSCALL_SKIP:
-		return 0;
-	default:
+	state = convert_lookup(out_fd);
+	if (state && state->hs != CONVERT_HS_IDLE &&
+		_write_prepare(state, NULL, 0, 0) < 0)
 		return -1;
-	}
+
+	return SYS(sendfile64)(out_fd, in_fd, offset, count);
 }
 
 ssize_t
-send(int sockfd, const void *buf, size_t len, int flags)
+splice(int fd_in, loff_t *off_in, int fd_out, loff_t *off_out, size_t len,
+	   unsigned int flags)
 {
+	int dontwait = flags & SPLICE_F_NONBLOCK ? MSG_DONTWAIT : 0;
 	socket_state_t *state;
-	ssize_t (*lsend)(int, const void *, size_t, int) = dlsym(RTLD_NEXT, "send");
+	int ret;
 
-	state = _lookup(sockfd);
-	if (!state)
-		return lsend(sockfd, buf, len, flags);
+	state = convert_lookup(fd_out);
+	if (state && state->hs != CONVERT_HS_IDLE &&
+		_write_prepare(state, NULL, 0, dontwait) < 0)
+		return -1;
 
-	switch (_read_convert(state, false, ECONNREFUSED))
+	state = convert_lookup(fd_in);
+	if (state)
 	{
-	case SYSCALL_RUN:
-		return lsend(sockfd, buf, len, flags);
-	case SYSCALL_SKIP:
-		return 0;
-	default:
-		return -1;
+		ret = _read_prepare(state, dontwait);
+		if (ret < 0)
+			return -1;
+
+		/* the app data that came with the reply is no longer in the
+		 * socket: hand it over from our buffer.
+		 */
+		if (ret > 0)
+		{
+			size_t n = state->rx_len - state->rx_off;
+			ssize_t written;
+
+			if (n > len)
+				n = len;
+
+			written = off_out ? pwrite(fd_out, state->rx + state->rx_off, n,
+									   *off_out)
+							  : write(fd_out, state->rx + state->rx_off, n);
+			if (written > 0)
+			{
+				if (off_out)
+					*off_out += written;
+				state->rx_off += written;
+				_release_if_done(state);
+			}
+			pthread_mutex_unlock(&state->lock);
+			return written;
+		}
 	}
+
+	return SYS(splice)(fd_in, off_in, fd_out, off_out, len, flags);
 }
 
 static int
@@ -486,7 +1599,7 @@ _read_sysctl_fastopen(unsigned int *flags)
 	fd = open("/proc/sys/net/ipv4/tcp_fastopen", O_RDONLY);
 	if (fd < 0)
 	{
-		printf("unable to open /proc/sys/net/ipv4/tcp_fastopen: %s\n",
+		log_warn("unable to open /proc/sys/net/ipv4/tcp_fastopen: %s",
 			   strerror(errno));
 		return fd;
 	}
@@ -496,7 +1609,7 @@ _read_sysctl_fastopen(unsigned int *flags)
 
 	if (rc < 0)
 	{
-		printf("unable to read /proc/sys/net/ipv4/tcp_fastopen: %s\n",
+		log_warn("unable to read /proc/sys/net/ipv4/tcp_fastopen: %s",
 			   strerror(errno));
 		return rc;
 	}
@@ -506,7 +1619,7 @@ _read_sysctl_fastopen(unsigned int *flags)
 
 	if (*endp && *endp != '\n')
 	{
-		printf("unable to parse /proc/sys/net/ipv4/tcp_fastopen\n");
+		log_warn("unable to parse /proc/sys/net/ipv4/tcp_fastopen");
 		return -1;
 	}
 
@@ -528,17 +1641,41 @@ _validate_sysctl_fastopen()
 	 */
 	if ((flags & expected_flags) != expected_flags)
 	{
-		printf("the sysctl tcp_fastopen has an inappropriate value. Expect %x got %x.\n", expected_flags,
+		log_warn("the sysctl tcp_fastopen has an inappropriate value. Expect %x got %x.", expected_flags,
 			   flags);
 		return -1;
 	}
 
-	printf("fastopen sysctl is %x, expect flags %x to be set\n", flags,
+	log_debug("fastopen sysctl is %x, expect flags %x to be set", flags,
 		   expected_flags);
 
 	return 0;
 }
 
+/* fastopen is opt-in: when the host cannot honour it, keep running
+ * with regular connects instead of failing.
+ */
+static void
+_validate_fastopen()
+{
+	/* MPTCP accepts data in the SYN since 6.2. */
+	if (_kernel_version < 6 || (_kernel_version == 6 && _kernel_major < 2))
+	{
+		log_warn("fastopen over MPTCP needs at least kernel 6.2, disabling it");
+		atomic_store(&_convert_fastopen, false);
+		return;
+	}
+
+	if (_validate_sysctl_fastopen() < 0)
+	{
+		log_warn("disabling fastopen");
+		atomic_store(&_convert_fastopen, false);
+		return;
+	}
+
+	log_info("sysctl tcp_fastopen is set correctly");
+}
+
 static void
 _extract_kernel_version(const char *release, int *version, int *major)
 {
@@ -553,38 +1690,64 @@ static int
 _validate_kernel_version()
 {
 	struct utsname kernel;
-	int version, major;
 
 	if (uname(&kernel) != 0)
 	{
-		printf("unable to retrieve the kernel version: %s\n",
+		log_error("unable to retrieve the kernel version: %s",
 			   strerror(errno));
 		return -1;
 	}
 
-	printf("running kernel version: %s\n", kernel.release);
+	log_debug("running kernel version: %s", kernel.release);
 
-	_extract_kernel_version(kernel.release, &version, &major);
-	printf("kernel base version: %d.%d\n", version, major);
+	_extract_kernel_version(kernel.release, &_kernel_version,
+							&_kernel_major);
+	log_info("kernel base version: %d.%d", _kernel_version, _kernel_major);
 
 	/* The TCP stack will acknowledge data sent in the SYN+ACK. */
-	if (version > 4 || (version == 4 && major >= 5))
+	if (_kernel_version > 4 || (_kernel_version == 4 && _kernel_major >= 5))
 		return 0;
 
-	printf("need at least kernel 4.5 to run this correctly\n");
+	log_error("need at least kernel 4.5 to run this correctly");
 	return -1;
 }
 
+static int
+_connect_template_init(void)
+{
+	struct convert_opts opts = {0};
+
+	if (_convert_cookie)
+	{
+		opts.flags |= CONVERT_F_COOKIE;
+		opts.cookie_len = strlen(_convert_cookie);
+		opts.cookie_data = (uint8_t *)_convert_cookie;
+	}
+
+	return convert_template_init(&_connect_template, &opts);
+}
+
 static int
 _validate_parameters()
 {
 	const char *convert_addr = getenv("CONVERT_ADDR");
 	const char *convert_port = getenv("CONVERT_PORT");
 	const char *convert_cookie = getenv("CONVERT_COOKIE");
+	const char *convert_fastopen = getenv("CONVERT_FASTOPEN");
+	const char *convert_pipeline = getenv("CONVERT_PIPELINE");
+	const char *convert_optimistic = getenv("CONVERT_OPTIMISTIC");
+	const char *convert_pool_size = getenv("CONVERT_POOL_SIZE");
+	int pool_size = 0;
+	const char *convert_race = getenv("CONVERT_RACE");
+	const char *convert_race_delay = getenv("CONVERT_RACE_DELAY");
+	int race_delay = -1;
+	const char *convert_resolve_ttl = getenv("CONVERT_RESOLVE_TTL");
+	const char *convert_policy = getenv("CONVERT_POLICY");
+	int resolve_ttl = CONVERT_RESOLVE_TTL_S;
 
 	if (!convert_addr)
 	{
-		printf("environment variable 'CONVERT_ADDR' missing\n");
+		log_error("environment variable 'CONVERT_ADDR' missing");
 		return -1;
 	}
 
@@ -597,8 +1760,8 @@ _validate_parameters()
 		strtol(convert_port, &endp, 10);
 
 		if (*endp && *endp != '\n')
-			printf(
-				"unable to parse port: %s. Falling back to default port.\n",
+			log_warn(
+				"unable to parse port: %s. Falling back to default port.",
 				convert_port);
 		else
 			_convert_port = convert_port;
@@ -607,18 +1770,99 @@ _validate_parameters()
 	if (convert_cookie)
 		_convert_cookie = convert_cookie;
 
-	/* resolve address */
-	if (getaddrinfo(convert_addr, _convert_port, NULL,
-					&_converter_addr) != 0)
+	if (convert_fastopen && strcmp(convert_fastopen, "1") == 0)
+		atomic_store(&_convert_fastopen, true);
+
+	if (convert_pipeline && strcmp(convert_pipeline, "1") == 0)
+		_convert_pipeline = true;
+
+	if (convert_optimistic && strcmp(convert_optimistic, "1") == 0)
+		_convert_optimistic = true;
+
+	if (convert_pool_size)
+	{
+		char *endp;
+
+		/* contains a base 10 number */
+		pool_size = strtol(convert_pool_size, &endp, 10);
+
+		if ((*endp && *endp != '\n') || pool_size < 0)
+		{
+			log_warn("unable to parse pool size: %s. Not pooling.",
+				   convert_pool_size);
+			pool_size = 0;
+		}
+	}
+
+	if (convert_race && strcmp(convert_race, "1") == 0)
+	{
+		race_delay = CONVERT_RACE_DELAY_MS;
+
+		if (convert_race_delay)
+		{
+			char *endp;
+
+			/* contains a base 10 number of milliseconds */
+			race_delay = strtol(convert_race_delay, &endp, 10);
+
+			if ((*endp && *endp != '\n') || race_delay < 0)
+			{
+				log_warn("unable to parse race delay: %s. Falling back to %d ms.",
+					   convert_race_delay, CONVERT_RACE_DELAY_MS);
+				race_delay = CONVERT_RACE_DELAY_MS;
+			}
+		}
+
+		convert_race_init(race_delay);
+	}
+
+	if (convert_resolve_ttl)
+	{
+		char *endp;
+
+		/* contains a base 10 number of seconds */
+		resolve_ttl = strtol(convert_resolve_ttl, &endp, 10);
+
+		if ((*endp && *endp != '\n') || resolve_ttl < 0)
+		{
+			log_warn("unable to parse resolve TTL: %s. Falling back to %d s.",
+				   convert_resolve_ttl, CONVERT_RESOLVE_TTL_S);
+			resolve_ttl = CONVERT_RESOLVE_TTL_S;
+		}
+	}
+
+	if (convert_policy && convert_policy_load(convert_policy) < 0)
+		return -1;
+
+	if (_connect_template_init() < 0)
+	{
+		log_error("unable to build the convert header");
+		return -1;
+	}
+
+	/* resolved by the first connect */
+	if (convert_endpoints_init(convert_addr, _convert_port, resolve_ttl) < 0)
+		return -1;
+
+	if (convert_pool_init(pool_size) < 0)
 	{
-		printf("unable to resolve '%s'\n", convert_addr);
+		log_error("unable to set up the connection pool");
 		return -1;
 	}
 
-	printf("connecting to convert service at %s:%s%s%s\n",
+	log_info("connecting to convert service at %s (default port %s)%s%s%s%s%s",
 		   convert_addr, _convert_port,
 		   _convert_cookie ? " with cookie: " : "",
-		   _convert_cookie ?: "");
+		   _convert_cookie ?: "",
+		   atomic_load(&_convert_fastopen) ? " using fastopen" : "",
+		   _convert_pipeline ? " pipelined" : "",
+		   _convert_optimistic ? " optimistic" : "");
+	if (pool_size)
+		log_info("keeping %d pooled connections", pool_size);
+	if (race_delay >= 0)
+		log_info("racing direct connects after %d ms", race_delay);
+	if (resolve_ttl)
+		log_info("resolving the converters again every %d s", resolve_ttl);
 
 	return 0;
 }
@@ -628,68 +1872,51 @@ _validate_config()
 {
 	int ret = 0;
 
-	ret = _validate_sysctl_fastopen();
+	ret = _validate_kernel_version();
 	if (ret < 0)
 		return ret;
 
-	printf("sysctl tcp_fastopen is set correctly\n");
+	log_debug("kernel version is set correctly");
 
-	ret = _validate_kernel_version();
+	ret = _validate_parameters();
 	if (ret < 0)
 		return ret;
 
-	printf("kernel version is set correctly\n");
-
-	return _validate_parameters();
-}
+	if (atomic_load(&_convert_fastopen))
+		_validate_fastopen();
 
-static void
-_log_lock(UNUSED void *udata, int lock)
-{
-	if (lock)
-		pthread_mutex_lock(&_log_mutex);
-	else
-		pthread_mutex_unlock(&_log_mutex);
+	return 0;
 }
 
 static __attribute__((constructor)) void
 init(void)
 {
-	char err_buf[1024];
 	const char *log_path = getenv("CONVERT_LOG");
-
-	// log_set_quiet(1);
-	// log_set_lock(_log_lock);
+	const char *convert_upgrade_tcp = getenv("CONVERT_UPGRADE_TCP");
 
 	/* open the log iff specified */
-	// if (log_path)
-	// {
-	// 	_log = fopen(log_path, "w");
-	// 	if (!_log)
-	// 		fprintf(stderr, "convert: unable to open log %s: %s",
-	// 				log_path, strerror(errno));
-	// 	log_set_fp(_log);
-	// }
+	if (convert_log_init(log_path, getenv("CONVERT_LOG_LEVEL")) < 0)
+		fprintf(stderr, "convert: unable to open log %s: %s\n", log_path,
+				strerror(errno));
 
-	printf("Starting interception\n");
+	log_debug("Starting interception");
 
-	if (_validate_config() < 0)
-	{
-		printf("init failed\n");
-		printf("Unable to setup connection interception: %s.\n",
-			   err_buf);
-		exit(1);
-	}
-	printf("init done\n");
+	/* the rest waits for the first managed connect */
+	convert_resolve_syscalls();
+	_alloc_table();
+
+	/* needed from the first socket() */
+	if (convert_upgrade_tcp && strcmp(convert_upgrade_tcp, "1") == 0)
+		atomic_store(&_convert_upgrade_tcp, true);
+
+	log_debug("init done");
 }
 
 static __attribute__((destructor)) void
 fini(void)
 {
-	printf("Terminating interception\n");
-
-	freeaddrinfo(_converter_addr);
+	log_debug("Terminating interception");
 
-	if (_log)
-		fclose(_log);
+	convert_stats_fini();
+	convert_log_fini();
 }
\ No newline at end of file
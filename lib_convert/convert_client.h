@@ -0,0 +1,363 @@
+/**
+ * Copyright(c) 2019, Tessares S.A.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ * list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and / or other materials provided with the distribution.
+ *
+ * 3. Neither the name of the copyright holder nor the names of its
+ * contributors may be used to endorse or promote products derived from
+ * this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED.IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ *        SERVICES; LOSS OF USE, DATA, OR PROFITS;
+ *        OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT(INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/* Internal definitions shared by the translation units of the
+ * interception library.
+ */
+
+#ifndef _CONVERT_CLIENT_H_
+#define _CONVERT_CLIENT_H_
+
+#include <netdb.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <sys/epoll.h>
+#include <sys/select.h>
+#include <sys/socket.h>
+
+#include "convert_util.h"
+
+/* Progress of the Convert handshake on a managed socket. */
+enum
+{
+	CONVERT_HS_IDLE = 0,	/* connect() not called yet */
+	CONVERT_HS_CONNECTING,	/* connection to the converter in progress */
+	CONVERT_HS_SEND_HDR,	/* CONNECT TLV not completely sent */
+	CONVERT_HS_WAIT_REPLY,	/* waiting for the converter's reply */
+	CONVERT_HS_DONE,
+	CONVERT_HS_ERROR,
+};
+
+/* State for each created TCP-based socket */
+typedef struct socket_state
+{
+	int fd;
+	/* read without the lock to tell whether the socket needs us */
+	atomic_int hs;
+	/* serializes the handshake steps and the reads of the buffered
+	 * reply between the threads using the socket
+	 */
+	pthread_mutex_t lock;
+	/* errno reported to the app once the handshake failed */
+	int error;
+
+	/* destination the app connected to */
+	struct sockaddr_storage dest;
+
+	/* Convert message sent to the converter */
+	uint8_t tx[CONVERT_MSG_MAX_LEN];
+	size_t tx_len;
+	size_t tx_off;
+
+	/* Convert reply received so far; rx_need is the full length of the
+	 * reply, known once its header was read. Once the handshake is done,
+	 * app data that came with the reply is buffered from rx_off to rx_len.
+	 */
+	uint8_t rx[CONVERT_MSG_MAX_LEN];
+	size_t rx_len;
+	size_t rx_need;
+	size_t rx_off;
+
+	/* the connection to the converter is opened by the first send of
+	 * the Convert message, which then rides in the SYN.
+	 */
+	bool syn_pending;
+	/* the CONNECT TLV was carried in the SYN */
+	bool fastopen;
+
+	/* converter endpoint in use (held, -1 if none), and the ones this
+	 * connect tried
+	 */
+	int endpoint;
+	uint32_t endpoints_tried;
+	long hs_start_us;
+	/* start of the connection to the converter, and end of the CONNECT
+	 * TLV, for the statistics
+	 */
+	long connect_start_us;
+	long hdr_sent_us;
+	/* app data went to the converter before its reply: no failover */
+	bool app_sent;
+	/* MPTCP socket created in place of the app's TCP one */
+	bool upgraded;
+	/* policy rule the destination matched, -1 if none */
+	int policy_rule;
+
+	/* epoll set the app registered the socket in (-1 if none), with the
+	 * app's own registration. While the handshake is pending the kernel
+	 * holds a registration of ours instead, see convert_poll.c.
+	 * ep_reported holds the events reported since the app last armed
+	 * the registration, for EPOLLET and EPOLLONESHOT. ep_tag_fd is the
+	 * epoll set ours was registered in (-1 if none), kept once the
+	 * app's is restored so that late events of ours are told apart.
+	 */
+	int ep_fd;
+	struct epoll_event ep_event;
+	uint32_t ep_kevents;
+	bool ep_tagged;
+	int ep_tag_fd;
+	_Atomic uint32_t ep_reported;
+	struct socket_state *ep_next;
+	bool ep_listed;
+
+	/* the socket is no longer managed. The state is only freed once the
+	 * fd is closed, as other threads may still hold it.
+	 */
+	atomic_bool released;
+} socket_state_t;
+
+/* Real libc entry points, resolved once by init(). */
+struct convert_syscalls
+{
+	int (*socket)(int, int, int);
+	int (*connect)(int, const struct sockaddr *, socklen_t);
+	int (*close)(int);
+	ssize_t (*send)(int, const void *, size_t, int);
+	ssize_t (*recv)(int, void *, size_t, int);
+	ssize_t (*sendmsg)(int, const struct msghdr *, int);
+	ssize_t (*recvfrom)(int, void *, size_t, int, struct sockaddr *,
+						socklen_t *);
+	ssize_t (*recvmsg)(int, struct msghdr *, int);
+	ssize_t (*sendto)(int, const void *, size_t, int, const struct sockaddr *,
+					  socklen_t);
+	ssize_t (*read)(int, void *, size_t);
+	ssize_t (*readv)(int, const struct iovec *, int);
+	ssize_t (*write)(int, const void *, size_t);
+	ssize_t (*writev)(int, const struct iovec *, int);
+	ssize_t (*sendfile)(int, int, off_t *, size_t);
+	ssize_t (*sendfile64)(int, int, off64_t *, size_t);
+	ssize_t (*splice)(int, loff_t *, int, loff_t *, size_t, unsigned int);
+	int (*poll)(struct pollfd *, nfds_t, int);
+	int (*select)(int, fd_set *, fd_set *, fd_set *, struct timeval *);
+	int (*epoll_ctl)(int, int, int, struct epoll_event *);
+	int (*epoll_wait)(int, struct epoll_event *, int, int);
+	int (*epoll_pwait)(int, struct epoll_event *, int, int,
+					   const sigset_t *);
+};
+
+extern struct convert_syscalls convert_sys;
+
+void convert_resolve_syscalls(void);
+
+/* Another library's constructor may call into us before init() ran. */
+#define SYS(name)                                       \
+	(__builtin_expect(convert_sys.name != NULL, 1)      \
+		 ? convert_sys.name                             \
+		 : (convert_resolve_syscalls(), convert_sys.name))
+
+/* Socket states are indexed directly by fd. Slots are published and
+ * retired with atomic exchanges, so a lookup never takes a lock and an
+ * unmanaged fd costs a bounds check and a single load. fds beyond
+ * convert_socket_table_size are never managed.
+ *
+ * Once the handshake is over, the state is released: lookups no longer
+ * return it, but it stays in its slot until close(), so that a pointer
+ * another thread got from convert_lookup() remains valid.
+ */
+extern _Atomic(socket_state_t *) *convert_socket_table;
+extern size_t convert_socket_table_size;
+/* number of states in the table */
+extern atomic_int convert_socket_count;
+
+static inline socket_state_t *
+convert_lookup(int fd)
+{
+	socket_state_t *state;
+
+	if ((size_t)fd >= convert_socket_table_size)
+		return NULL;
+
+	state = atomic_load_explicit(&convert_socket_table[fd], memory_order_acquire);
+	if (state && atomic_load_explicit(&state->released, memory_order_acquire))
+		return NULL;
+	return state;
+}
+
+/* Whether the app bound the socket to a local address or port. */
+bool convert_socket_bound(int fd);
+
+/* Move the state's fd onto the socket fd, which is closed, carrying over
+ * the file flags and the common socket options. Returns -1 on failure,
+ * leaving fd open.
+ */
+int convert_socket_move(socket_state_t *state, int fd);
+
+/* Open the path to the converter for the CONNECT TLV in the state's tx.
+ * Returns -1 with errno set if the converter cannot be used.
+ */
+int convert_start(socket_state_t *state);
+
+/* Handshake state from which connect() reports the socket as connected. */
+int convert_connect_until(void);
+
+/* Drive the handshake until it reaches the state `until`. Returns 0 once
+ * reached, or -1 with errno set (EAGAIN when a step would block, or when
+ * another thread is in the middle of one with MSG_DONTWAIT).
+ */
+int convert_handshake(socket_state_t *state, int until, int flags);
+
+/* convert_poll.c */
+
+/* Align the kernel's epoll registration of a managed socket with its
+ * handshake state.
+ */
+void convert_epoll_sync(socket_state_t *state);
+
+/* The state is about to be freed; restore_app hands the app's own
+ * registration back to the kernel when the fd stays open.
+ */
+void convert_epoll_release(socket_state_t *state, bool restore_app);
+
+/* The state's fd now refers to another socket, which dropped the app's
+ * epoll registration: register it again.
+ */
+void convert_epoll_moved(socket_state_t *state);
+
+/* convert_endpoint.c */
+
+/* endpoints tried by a connect are tracked in a 32-bit mask */
+#define CONVERT_MAX_ENDPOINTS 32
+
+/* Default lifetime of the resolution of the converter names. */
+#define CONVERT_RESOLVE_TTL_S 300
+
+/* Use the comma-separated list of converters, resolved again every ttl_s
+ * seconds (never if 0). Returns -1 on failure.
+ */
+int convert_endpoints_init(const char *list, const char *default_port,
+						   int ttl_s);
+
+/* Resolve the converters when due: inline the first time, in the
+ * background once some are known. Returns -1 if none is known.
+ */
+int convert_endpoints_resolve(void);
+int convert_endpoint_count(void);
+const struct sockaddr *convert_endpoint_addr(int i, socklen_t *addrlen);
+const char *convert_endpoint_name(int i);
+
+/* TCP option kind of fastopen, which carries the CONNECT TLV in the SYN */
+#define CONVERT_TCPOPT_FASTOPEN 34
+
+/* Whether the converter at endpoint i supports the TCP option kind: true
+ * unless it said otherwise.
+ */
+bool convert_endpoint_supports(int i, uint8_t kind);
+
+/* The converter reported the TCP option kinds as unsupported. */
+void convert_endpoint_unsupported(int i, const uint8_t *kinds, size_t len);
+
+/* Best endpoint not in the `tried` mask, -1 if none is left. The caller
+ * holds it until convert_endpoint_put(): meanwhile its slot does not go
+ * to another address.
+ */
+int convert_endpoint_pick(uint32_t tried);
+void convert_endpoint_put(int i);
+void convert_endpoint_success(int i, long latency_us);
+void convert_endpoint_failure(int i);
+
+/* convert_pool.c */
+
+/* Keep up to `size` warm connections to the converter endpoints (none
+ * if size is 0). Returns -1 on failure.
+ */
+int convert_pool_init(int size);
+
+/* Move a pooled connection to the converter onto the state's fd. Returns
+ * -1 if none is available, leaving the app's socket untouched.
+ */
+int convert_pool_take(socket_state_t *state);
+
+/* convert_race.c */
+
+/* Default head start of the converter path over the direct one. */
+#define CONVERT_RACE_DELAY_MS 250
+
+/* Path to a destination, as learned by a race. */
+enum
+{
+	CONVERT_PATH_UNKNOWN = 0,
+	CONVERT_PATH_CONVERTER,
+	CONVERT_PATH_DIRECT,
+};
+
+/* Race a direct connection, started delay_ms after the converter one,
+ * for destinations whose best path is not known yet.
+ */
+void convert_race_init(int delay_ms);
+
+/* Cached path to addr; CONVERT_PATH_UNKNOWN when racing is disabled. */
+int convert_race_lookup(const struct sockaddr *addr);
+
+void convert_race_forget(const struct sockaddr *addr);
+
+/* Whether connect() on the state's socket can be raced. */
+bool convert_race_wanted(socket_state_t *state);
+
+/* Connect the state's socket to addr through whichever path wins. Returns
+ * the winning path, or -1 with errno set if both failed. When the direct
+ * path wins the fd is moved onto the direct connection and the state is
+ * no longer needed.
+ */
+int convert_race_connect(socket_state_t *state, const struct sockaddr *addr,
+						 socklen_t addrlen);
+
+/* convert_policy.c */
+
+/* Actions of the policy rules. */
+enum
+{
+	CONVERT_POLICY_CONVERT = 0,
+	CONVERT_POLICY_DIRECT,
+	/* convert until it fails once, then direct */
+	CONVERT_POLICY_BYPASS,
+};
+
+/* Compile the rules of the policy file. Returns -1 if it is invalid. */
+int convert_policy_load(const char *path);
+
+/* Action for a connect to addr, CONVERT_POLICY_CONVERT or
+ * CONVERT_POLICY_DIRECT. *rule is set to the matching rule, -1 if none.
+ */
+int convert_policy_lookup(const struct sockaddr *addr, int *rule);
+
+/* A converted connect matching the rule failed. */
+void convert_policy_failed(int rule);
+
+/* Apply the tuning profile of the rule to the socket. */
+void convert_policy_tune(int rule, int fd);
+
+/* Whether the connection to the converter is reset when the handshake
+ * fails, rather than closed gracefully.
+ */
+bool convert_policy_abort_on_error(int rule);
+
+#endif
@@ -0,0 +1,665 @@
+/**
+ * Copyright(c) 2019, Tessares S.A.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ * list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and / or other materials provided with the distribution.
+ *
+ * 3. Neither the name of the copyright holder nor the names of its
+ * contributors may be used to endorse or promote products derived from
+ * this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED.IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ *        SERVICES; LOSS OF USE, DATA, OR PROFITS;
+ *        OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT(INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/* Converter endpoints.
+ *
+ * CONVERT_ADDR holds a comma-separated list of converters, each a host
+ * name or address with an optional port ("host:port", "[v6addr]:port"),
+ * CONVERT_PORT otherwise. Every address a name resolves to is an
+ * endpoint. Each connect goes to the healthy endpoint with the lowest
+ * smoothed handshake latency; an endpoint that fails is put aside for a
+ * backoff that grows with its consecutive failures.
+ *
+ * The names are resolved by the first connect, then again in the
+ * background once the resolution is older than its TTL. An address that
+ * disappears is retired. Its slot only goes to a new address once no
+ * connect, pooled connection or INFO query holds it, so that the index
+ * they hold stays valid.
+ *
+ * After its first successful handshake, an endpoint is asked once for
+ * the TCP extensions it supports with an INFO TLV, in the background. The
+ * kinds it does not support, or reports as unsupported in an error, are
+ * cached for the lifetime of the endpoint.
+ */
+
+#define _GNU_SOURCE
+#include <netdb.h>
+#include <netinet/tcp.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+#include <time.h>
+
+#include "convert_client.h"
+#include "convert_log.h"
+
+/* first backoff of a failed endpoint, doubled on each failure */
+#define CONVERT_ENDPOINT_BACKOFF_MS 1000
+#define CONVERT_ENDPOINT_BACKOFF_MAX_MS 60000
+/* next attempt after a resolution that found nothing */
+#define CONVERT_RESOLVE_RETRY_MS 5000
+/* a converter that did not answer the INFO TLV by then never will */
+#define CONVERT_INFO_TIMEOUT_S 2
+
+/* Progress of the INFO query of an endpoint. */
+enum
+{
+	ENDPOINT_INFO_UNKNOWN = 0,
+	ENDPOINT_INFO_PENDING,
+	ENDPOINT_INFO_KNOWN,
+	/* no answer: every extension is assumed to be supported */
+	ENDPOINT_INFO_FAILED,
+};
+
+struct convert_endpoint
+{
+	struct sockaddr_storage addr;
+	socklen_t addrlen;
+	char name[NI_MAXHOST + NI_MAXSERV + 4];
+
+	/* smoothed handshake latency, 0 until measured */
+	long srtt_us;
+	unsigned int failures;
+	long down_until_ms;
+	/* no longer returned by the last resolution */
+	bool retired;
+	/* holders of the slot, see convert_endpoint_pick() */
+	atomic_int refs;
+
+	atomic_int info;
+	/* bitmap of the TCP option kinds the converter does not support */
+	_Atomic uint32_t unsupported[256 / 32];
+};
+
+static struct convert_endpoint _endpoints[CONVERT_MAX_ENDPOINTS];
+static atomic_int _endpoint_count;
+static pthread_mutex_t _endpoint_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static char *_endpoint_list;
+static const char *_default_port;
+static long _resolve_ttl_ms;
+static long _next_resolve_ms;
+/* serializes the resolutions */
+static pthread_mutex_t _resolve_lock = PTHREAD_MUTEX_INITIALIZER;
+static atomic_bool _refreshing;
+
+static long
+_now_ms(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/* Addresses returned by one resolution of the list. */
+struct resolved
+{
+	struct sockaddr_storage addr[CONVERT_MAX_ENDPOINTS];
+	socklen_t addrlen[CONVERT_MAX_ENDPOINTS];
+	int count;
+};
+
+static void
+_resolved_add(struct resolved *res, const struct addrinfo *ai)
+{
+	int i;
+
+	for (i = 0; i < res->count; i++)
+		if (res->addrlen[i] == ai->ai_addrlen &&
+			memcmp(&res->addr[i], ai->ai_addr, ai->ai_addrlen) == 0)
+			return;
+
+	if (res->count == CONVERT_MAX_ENDPOINTS)
+	{
+		log_warn("too many converter endpoints, ignoring the extra ones");
+		return;
+	}
+
+	memcpy(&res->addr[res->count], ai->ai_addr, ai->ai_addrlen);
+	res->addrlen[res->count++] = ai->ai_addrlen;
+}
+
+/* Fill a slot with addr: a retired one nobody holds any more, or the
+ * next one. Called with _endpoint_lock held.
+ */
+static void
+_endpoint_add(const struct sockaddr *addr, socklen_t addrlen)
+{
+	struct convert_endpoint *ep;
+	char host[NI_MAXHOST];
+	char serv[NI_MAXSERV];
+	size_t j;
+	int i;
+
+	for (i = 0; i < _endpoint_count; i++)
+		if (_endpoints[i].retired &&
+			!atomic_load_explicit(&_endpoints[i].refs, memory_order_acquire))
+			break;
+
+	if (i == CONVERT_MAX_ENDPOINTS)
+	{
+		log_warn("no slot left for a new converter endpoint");
+		return;
+	}
+
+	ep = &_endpoints[i];
+	memcpy(&ep->addr, addr, addrlen);
+	ep->addrlen = addrlen;
+
+	if (getnameinfo(addr, addrlen, host, sizeof(host), serv, sizeof(serv),
+					NI_NUMERICHOST | NI_NUMERICSERV) != 0)
+		snprintf(ep->name, sizeof(ep->name), "endpoint %d", i);
+	else if (addr->sa_family == AF_INET6)
+		snprintf(ep->name, sizeof(ep->name), "[%s]:%s", host, serv);
+	else
+		snprintf(ep->name, sizeof(ep->name), "%s:%s", host, serv);
+
+	/* nothing of the previous address carries over */
+	ep->srtt_us = 0;
+	ep->failures = 0;
+	ep->down_until_ms = 0;
+	ep->retired = false;
+	atomic_store(&ep->info, ENDPOINT_INFO_UNKNOWN);
+	for (j = 0; j < sizeof(ep->unsupported) / sizeof(ep->unsupported[0]); j++)
+		atomic_store(&ep->unsupported[j], 0);
+
+	/* lock-free readers only look at slots below the count */
+	if (i == _endpoint_count)
+		atomic_store_explicit(&_endpoint_count, _endpoint_count + 1,
+							  memory_order_release);
+	log_info("converter endpoint %s", ep->name);
+}
+
+/* Split "host", "host:port" or "[host]:port" in place. */
+static void
+_split_host_port(char *entry, char **host, char **port)
+{
+	char *sep;
+
+	*host = entry;
+	*port = NULL;
+
+	if (*entry == '[')
+	{
+		sep = strchr(entry, ']');
+		if (!sep)
+			return;
+
+		*host = entry + 1;
+		*sep++ = '\0';
+		if (*sep == ':')
+			*port = sep + 1;
+		return;
+	}
+
+	/* more than one colon: a bare IPv6 address */
+	sep = strchr(entry, ':');
+	if (sep && !strchr(sep + 1, ':'))
+	{
+		*sep = '\0';
+		*port = sep + 1;
+	}
+}
+
+static void
+_resolve_list(struct resolved *res)
+{
+	struct addrinfo hints = {
+		.ai_socktype = SOCK_STREAM,
+	};
+	char *copy = strdup(_endpoint_list);
+	char *saveptr = NULL;
+	char *entry;
+
+	res->count = 0;
+	if (!copy)
+		return;
+
+	for (entry = strtok_r(copy, ", ", &saveptr); entry;
+		 entry = strtok_r(NULL, ", ", &saveptr))
+	{
+		struct addrinfo *ai_list, *ai;
+		char *host, *port;
+
+		_split_host_port(entry, &host, &port);
+
+		if (getaddrinfo(host, port ?: _default_port, &hints, &ai_list) != 0)
+		{
+			log_warn("unable to resolve '%s'", host);
+			continue;
+		}
+
+		for (ai = ai_list; ai; ai = ai->ai_next)
+			_resolved_add(res, ai);
+		freeaddrinfo(ai_list);
+	}
+
+	free(copy);
+}
+
+/* Resolve the list and merge the result in the endpoints. A resolution
+ * that finds nothing keeps the current ones.
+ */
+static void
+_resolve(void)
+{
+	struct resolved res;
+	int i, j;
+
+	_resolve_list(&res);
+
+	pthread_mutex_lock(&_endpoint_lock);
+	if (res.count)
+	{
+		for (i = 0; i < _endpoint_count; i++)
+		{
+			struct convert_endpoint *ep = &_endpoints[i];
+			bool retired = true;
+
+			for (j = 0; j < res.count; j++)
+				if (res.addrlen[j] == ep->addrlen &&
+					memcmp(&res.addr[j], &ep->addr, ep->addrlen) == 0)
+				{
+					/* known already */
+					res.addrlen[j] = 0;
+					retired = false;
+				}
+
+			if (retired && !ep->retired)
+				log_info("converter endpoint %s retired", ep->name);
+			ep->retired = retired;
+		}
+
+		for (j = 0; j < res.count; j++)
+			if (res.addrlen[j])
+				_endpoint_add((struct sockaddr *)&res.addr[j], res.addrlen[j]);
+	}
+
+	_next_resolve_ms = _now_ms() + (res.count ? _resolve_ttl_ms
+											  : CONVERT_RESOLVE_RETRY_MS);
+	pthread_mutex_unlock(&_endpoint_lock);
+}
+
+static void *
+_refresh(UNUSED void *arg)
+{
+	pthread_mutex_lock(&_resolve_lock);
+	_resolve();
+	pthread_mutex_unlock(&_resolve_lock);
+
+	log_debug("converters resolved again");
+	atomic_store(&_refreshing, false);
+	return NULL;
+}
+
+static void
+_start_refresh(void)
+{
+	pthread_t thread;
+	sigset_t all, old;
+
+	if (atomic_exchange(&_refreshing, true))
+		return;
+
+	/* leave the app's signals to the app's threads */
+	sigfillset(&all);
+	pthread_sigmask(SIG_SETMASK, &all, &old);
+
+	if (pthread_create(&thread, NULL, _refresh, NULL) == 0)
+		pthread_detach(thread);
+	else
+		atomic_store(&_refreshing, false);
+
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+}
+
+/* A resolution or INFO queries may be in progress in the parent. */
+static void
+_endpoint_atfork_child(void)
+{
+	int expected;
+	int i;
+
+	pthread_mutex_init(&_resolve_lock, NULL);
+	pthread_mutex_init(&_endpoint_lock, NULL);
+	atomic_store(&_refreshing, false);
+
+	for (i = 0; i < _endpoint_count; i++)
+	{
+		expected = ENDPOINT_INFO_PENDING;
+		/* the query's thread was not forked along */
+		if (atomic_compare_exchange_strong(&_endpoints[i].info, &expected,
+										   ENDPOINT_INFO_UNKNOWN))
+			convert_endpoint_put(i);
+	}
+}
+
+int
+convert_endpoints_init(const char *list, const char *default_port,
+					   int ttl_s)
+{
+	_endpoint_list = strdup(list);
+	if (!_endpoint_list)
+		return -1;
+
+	_default_port = default_port;
+	_resolve_ttl_ms = ttl_s * 1000L;
+
+	pthread_atfork(NULL, NULL, _endpoint_atfork_child);
+	return 0;
+}
+
+int
+convert_endpoints_resolve(void)
+{
+	long next;
+	int count;
+
+	pthread_mutex_lock(&_endpoint_lock);
+	next = _next_resolve_ms;
+	count = _endpoint_count;
+	pthread_mutex_unlock(&_endpoint_lock);
+
+	if (next > _now_ms())
+		return count ? 0 : -1;
+
+	if (count)
+	{
+		/* a TTL of 0 keeps the first resolution */
+		if (_resolve_ttl_ms)
+			_start_refresh();
+		return 0;
+	}
+
+	/* nothing to connect to yet: wait for the resolution */
+	pthread_mutex_lock(&_resolve_lock);
+	pthread_mutex_lock(&_endpoint_lock);
+	next = _next_resolve_ms;
+	pthread_mutex_unlock(&_endpoint_lock);
+
+	if (next <= _now_ms())
+		_resolve();
+	pthread_mutex_unlock(&_resolve_lock);
+
+	return convert_endpoint_count() ? 0 : -1;
+}
+
+int
+convert_endpoint_count(void)
+{
+	return atomic_load_explicit(&_endpoint_count, memory_order_acquire);
+}
+
+const struct sockaddr *
+convert_endpoint_addr(int i, socklen_t *addrlen)
+{
+	*addrlen = _endpoints[i].addrlen;
+	return (const struct sockaddr *)&_endpoints[i].addr;
+}
+
+const char *
+convert_endpoint_name(int i)
+{
+	return _endpoints[i].name;
+}
+
+/* Whether endpoint a is a better pick than b. */
+static bool
+_endpoint_better(const struct convert_endpoint *a,
+				 const struct convert_endpoint *b, long now)
+{
+	bool a_up = a->down_until_ms <= now;
+	bool b_up = b->down_until_ms <= now;
+
+	if (a_up != b_up)
+		return a_up;
+
+	/* all down: the one that comes back first */
+	if (!a_up)
+		return a->down_until_ms < b->down_until_ms;
+
+	/* unmeasured endpoints get their first measurement */
+	return a->srtt_us < b->srtt_us;
+}
+
+static void
+_endpoint_unsupported(struct convert_endpoint *ep, uint8_t kind)
+{
+	atomic_fetch_or(&ep->unsupported[kind / 32], 1u << (kind % 32));
+}
+
+/* Ask the converter for its TCP extensions; blocking. */
+static int
+_info_query(struct convert_endpoint *ep)
+{
+	struct convert_opts opts = {
+		.flags = CONVERT_F_INFO,
+	};
+	struct timeval timeout = {
+		.tv_sec = CONVERT_INFO_TIMEOUT_S,
+	};
+	uint8_t buff[CONVERT_MSG_MAX_LEN];
+	struct convert_parser parser;
+	bool supported[256] = {false};
+	ssize_t len;
+	size_t i;
+	int ret = -1;
+	int fd;
+
+	fd = SYS(socket)(ep->addr.ss_family, SOCK_STREAM | SOCK_CLOEXEC,
+					 IPPROTO_MPTCP);
+	if (fd < 0)
+		return -1;
+
+	/* the timeouts also bound connect() */
+	setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+	setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+
+	if (SYS(connect)(fd, (struct sockaddr *)&ep->addr, ep->addrlen) < 0)
+		goto out;
+
+	len = convert_write(buff, sizeof(buff), &opts);
+	if (len < 0 || SYS(send)(fd, buff, len, MSG_NOSIGNAL) != len)
+		goto out;
+
+	convert_parser_init(&parser);
+	do
+	{
+		len = SYS(recv)(fd, buff, convert_parser_want(&parser), 0);
+		if (len <= 0)
+			goto out;
+	} while (convert_parser_feed(&parser, buff, len, NULL) ==
+			 CONVERT_PARSE_MORE);
+
+	if (parser.state != CONVERT_PARSER_DONE ||
+		!(parser.opts.flags & CONVERT_F_SUPPORTED_TCP_EXT))
+		goto out;
+
+	for (i = 0; i < parser.opts.supported_tcp_ext_len; i++)
+		supported[parser.opts.supported_tcp_ext[i]] = true;
+
+	for (i = 0; i < 256; i++)
+		if (!supported[i])
+			_endpoint_unsupported(ep, i);
+
+	log_info("converter %s supports %zu TCP extensions", ep->name,
+			 parser.opts.supported_tcp_ext_len);
+	ret = 0;
+
+out:
+	SYS(close)(fd);
+	return ret;
+}
+
+static void *
+_info(void *arg)
+{
+	struct convert_endpoint *ep = arg;
+
+	if (_info_query(ep) == 0)
+		atomic_store(&ep->info, ENDPOINT_INFO_KNOWN);
+	else
+	{
+		log_debug("converter %s did not announce its TCP extensions",
+				  ep->name);
+		atomic_store(&ep->info, ENDPOINT_INFO_FAILED);
+	}
+
+	convert_endpoint_put(ep - _endpoints);
+	return NULL;
+}
+
+static void
+_start_info(struct convert_endpoint *ep)
+{
+	int expected = ENDPOINT_INFO_UNKNOWN;
+	pthread_t thread;
+	sigset_t all, old;
+
+	if (!atomic_compare_exchange_strong(&ep->info, &expected,
+										ENDPOINT_INFO_PENDING))
+		return;
+
+	/* the query holds the slot, as the caller does */
+	atomic_fetch_add(&ep->refs, 1);
+
+	/* leave the app's signals to the app's threads */
+	sigfillset(&all);
+	pthread_sigmask(SIG_SETMASK, &all, &old);
+
+	if (pthread_create(&thread, NULL, _info, ep) == 0)
+		pthread_detach(thread);
+	else
+	{
+		atomic_store(&ep->info, ENDPOINT_INFO_UNKNOWN);
+		convert_endpoint_put(ep - _endpoints);
+	}
+
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+}
+
+bool
+convert_endpoint_supports(int i, uint8_t kind)
+{
+	return !(atomic_load_explicit(&_endpoints[i].unsupported[kind / 32],
+								  memory_order_relaxed) &
+			 (1u << (kind % 32)));
+}
+
+void
+convert_endpoint_unsupported(int i, const uint8_t *kinds, size_t len)
+{
+	size_t j;
+
+	for (j = 0; j < len; j++)
+	{
+		/* the padding */
+		if (kinds[j] == TCPOPT_EOL)
+			continue;
+
+		if (convert_endpoint_supports(i, kinds[j]))
+			log_info("converter %s does not support the TCP option %u",
+					 _endpoints[i].name, kinds[j]);
+		_endpoint_unsupported(&_endpoints[i], kinds[j]);
+	}
+}
+
+int
+convert_endpoint_pick(uint32_t tried)
+{
+	long now = _now_ms();
+	int best = -1;
+	int i;
+
+	pthread_mutex_lock(&_endpoint_lock);
+	for (i = 0; i < _endpoint_count; i++)
+	{
+		if ((tried & (1u << i)) || _endpoints[i].retired)
+			continue;
+
+		if (best < 0 || _endpoint_better(&_endpoints[i], &_endpoints[best], now))
+			best = i;
+	}
+	if (best >= 0)
+		atomic_fetch_add(&_endpoints[best].refs, 1);
+	pthread_mutex_unlock(&_endpoint_lock);
+
+	return best;
+}
+
+void
+convert_endpoint_put(int i)
+{
+	if (i >= 0)
+		atomic_fetch_sub_explicit(&_endpoints[i].refs, 1, memory_order_release);
+}
+
+void
+convert_endpoint_success(int i, long latency_us)
+{
+	struct convert_endpoint *ep = &_endpoints[i];
+
+	pthread_mutex_lock(&_endpoint_lock);
+	/* EWMA with a gain of 1/8, as for the TCP SRTT */
+	if (ep->srtt_us)
+		ep->srtt_us += (latency_us - ep->srtt_us) / 8;
+	else
+		ep->srtt_us = latency_us > 0 ? latency_us : 1;
+	ep->failures = 0;
+	ep->down_until_ms = 0;
+	pthread_mutex_unlock(&_endpoint_lock);
+
+	_start_info(ep);
+}
+
+void
+convert_endpoint_failure(int i)
+{
+	struct convert_endpoint *ep = &_endpoints[i];
+	long backoff = CONVERT_ENDPOINT_BACKOFF_MS;
+	unsigned int failures;
+
+	pthread_mutex_lock(&_endpoint_lock);
+	failures = ++ep->failures;
+	for (; failures > 1 && backoff < CONVERT_ENDPOINT_BACKOFF_MAX_MS; failures--)
+		backoff *= 2;
+	if (backoff > CONVERT_ENDPOINT_BACKOFF_MAX_MS)
+		backoff = CONVERT_ENDPOINT_BACKOFF_MAX_MS;
+	ep->down_until_ms = _now_ms() + backoff;
+	pthread_mutex_unlock(&_endpoint_lock);
+
+	log_warn("converter %s failed, set aside for %ld ms", ep->name, backoff);
+}
@@ -0,0 +1,246 @@
+/**
+ * Copyright(c) 2019, Tessares S.A.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ * list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and / or other materials provided with the distribution.
+ *
+ * 3. Neither the name of the copyright holder nor the names of its
+ * contributors may be used to endorse or promote products derived from
+ * this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED.IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ *        SERVICES; LOSS OF USE, DATA, OR PROFITS;
+ *        OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT(INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+
+/* convert_fuzz: libFuzzer harness of the Convert codec.
+ *
+ * The first byte of an input picks the chunk size the streaming parser
+ * is fed with, the rest is the message. Every parser must agree on the
+ * message, and a parsed message must survive being written again. Inputs
+ * that crash are kept by libFuzzer; the one that took the longest to
+ * parse so far is written to CONVERT_FUZZ_SLOWEST.
+ *
+ * Without libFuzzer, build with -DCONVERT_FUZZ_STANDALONE to run the
+ * inputs given on the command line, files or directories.
+ */
+
+#define _GNU_SOURCE
+#include <dirent.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "convert_util.h"
+
+#define CONVERT_FUZZ_SLOWEST "convert-fuzz-slowest"
+#define CONVERT_FUZZ_MAX_CHUNK 16
+
+static long _slowest_ns;
+
+static long
+_now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000L + ts.tv_nsec;
+}
+
+static void
+_slowest(const uint8_t *data, size_t size, long ns)
+{
+	FILE *f;
+
+	if (ns <= _slowest_ns)
+		return;
+	_slowest_ns = ns;
+
+	fprintf(stderr, "slowest parse so far: %ld ns for %zu bytes\n", ns, size);
+
+	f = fopen(CONVERT_FUZZ_SLOWEST, "w");
+	if (!f)
+		return;
+	fwrite(data, 1, size, f);
+	fclose(f);
+}
+
+/* The message must read the same after being written again. */
+static void
+_check_rewrite(const struct convert_opts *opts)
+{
+	struct convert_opts_view view;
+	uint8_t buff[CONVERT_MSG_MAX_LEN];
+	ssize_t len;
+
+	/* every TLV can be written, in no more room than it was read from */
+	len = convert_write(buff, sizeof(buff), opts);
+	if (len < 0 ||
+		convert_parse_tlvs_view(buff + CONVERT_HDR_LEN,
+								len - CONVERT_HDR_LEN, &view) < 0 ||
+		view.flags != opts->flags)
+		abort();
+}
+
+static void
+_check(const uint8_t *msg, size_t len, size_t chunk)
+{
+	struct convert_parser whole, stream;
+	struct convert_opts_view view;
+	struct convert_opts *opts;
+	size_t tlvs_len, consumed, off;
+	int hdr_ret, view_ret, ret;
+
+	/* the one-shot parsers */
+	hdr_ret = convert_parse_header(msg, len, &tlvs_len);
+	if (hdr_ret == 0 && CONVERT_HDR_LEN + tlvs_len > len)
+		hdr_ret = -1;
+
+	view_ret = -1;
+	if (hdr_ret == 0 && tlvs_len)
+	{
+		view_ret = convert_parse_tlvs_view(msg + CONVERT_HDR_LEN, tlvs_len,
+										   &view);
+		opts = convert_parse_tlvs(msg + CONVERT_HDR_LEN, tlvs_len);
+		if ((opts != NULL) != (view_ret == 0))
+			abort();
+		if (opts)
+		{
+			if (opts->flags != view.flags)
+				abort();
+			_check_rewrite(opts);
+			convert_free_opts(opts);
+		}
+	}
+
+	/* the streaming parser, fed at once and in chunks */
+	convert_parser_init(&whole);
+	ret = convert_parser_feed(&whole, msg, len, &consumed);
+	if (ret == CONVERT_PARSE_DONE &&
+		(hdr_ret < 0 || consumed != CONVERT_HDR_LEN + tlvs_len ||
+		 (tlvs_len && view_ret < 0)))
+		abort();
+	if (ret == CONVERT_PARSE_MORE && consumed != len)
+		abort();
+
+	convert_parser_init(&stream);
+	for (off = 0; off < len; off += consumed)
+	{
+		size_t n = len - off < chunk ? len - off : chunk;
+
+		if (convert_parser_feed(&stream, msg + off, n, &consumed) !=
+			CONVERT_PARSE_MORE)
+		{
+			off += consumed;
+			break;
+		}
+	}
+
+	if (stream.state != whole.state)
+		abort();
+	if (ret == CONVERT_PARSE_DONE &&
+		(off != CONVERT_HDR_LEN + tlvs_len || stream.opts.flags != whole.opts.flags))
+		abort();
+}
+
+int
+LLVMFuzzerTestOneInput(const uint8_t *data, size_t size)
+{
+	long start;
+
+	if (size < 1)
+		return 0;
+
+	start = _now_ns();
+	_check(data + 1, size - 1, data[0] % CONVERT_FUZZ_MAX_CHUNK + 1);
+	_slowest(data, size, _now_ns() - start);
+
+	return 0;
+}
+
+#ifdef CONVERT_FUZZ_STANDALONE
+
+static int
+_run_file(const char *path)
+{
+	uint8_t data[CONVERT_MSG_MAX_LEN + 1];
+	size_t size;
+	FILE *f;
+
+	f = fopen(path, "r");
+	if (!f)
+	{
+		perror(path);
+		return -1;
+	}
+	size = fread(data, 1, sizeof(data), f);
+	fclose(f);
+
+	LLVMFuzzerTestOneInput(data, size);
+	return 0;
+}
+
+static int
+_run(const char *path)
+{
+	struct dirent *entry;
+	int ret = 0;
+	DIR *dir;
+
+	dir = opendir(path);
+	if (!dir)
+		return _run_file(path);
+
+	while ((entry = readdir(dir)) != NULL)
+	{
+		char file[PATH_MAX];
+
+		if (entry->d_name[0] == '.')
+			continue;
+
+		snprintf(file, sizeof(file), "%s/%s", path, entry->d_name);
+		if (_run_file(file) < 0)
+			ret = -1;
+	}
+
+	closedir(dir);
+	return ret;
+}
+
+int
+main(int argc, char *argv[])
+{
+	int ret = 0;
+	int i;
+
+	for (i = 1; i < argc; i++)
+	{
+		if (_run(argv[i]) < 0)
+			ret = 1;
+	}
+
+	printf("slowest parse: %ld ns\n", _slowest_ns);
+	return ret;
+}
+
+#endif
@@ -0,0 +1,326 @@
+/**
+ * Copyright(c) 2019, Tessares S.A.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ * list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and / or other materials provided with the distribution.
+ *
+ * 3. Neither the name of the copyright holder nor the names of its
+ * contributors may be used to endorse or promote products derived from
+ * this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED.IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ *        SERVICES; LOSS OF USE, DATA, OR PROFITS;
+ *        OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT(INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdarg.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "convert_log.h"
+
+/* power of 2 */
+#define CONVERT_LOG_RING_SLOTS 256
+#define CONVERT_LOG_MSG_LEN 240
+/* pause of the drain thread once the rings are empty */
+#define CONVERT_LOG_DRAIN_MS 20
+
+struct log_entry
+{
+	struct timespec ts;
+	int level;
+	/* the ring may change hands before the entry is drained */
+	pid_t tid;
+	char msg[CONVERT_LOG_MSG_LEN];
+};
+
+/* Single producer (the owning thread), single consumer (the drain). */
+struct log_ring
+{
+	atomic_size_t head;
+	atomic_size_t tail;
+	atomic_bool in_use;
+	/* of the owning thread */
+	pid_t tid;
+	/* set once before the ring is published */
+	struct log_ring *next;
+	struct log_entry entries[CONVERT_LOG_RING_SLOTS];
+};
+
+int convert_log_level = CONVERT_LOG_OFF;
+
+static const char *_level_names[] = {
+	"TRACE", "DEBUG", "INFO", "WARN", "ERROR",
+};
+
+static FILE *_log_fp;
+static _Atomic(struct log_ring *) _rings;
+static __thread struct log_ring *_ring;
+static pthread_key_t _ring_key;
+static atomic_ulong _dropped;
+
+/* serializes the consumers: the drain thread and convert_log_fini() */
+static pthread_mutex_t _drain_lock = PTHREAD_MUTEX_INITIALIZER;
+static atomic_bool _drain_started;
+static atomic_bool _drain_stop;
+
+/* The ring goes back to the free list when its thread exits. */
+static void
+_ring_release(void *ring)
+{
+	atomic_store_explicit(&((struct log_ring *)ring)->in_use, false,
+						  memory_order_release);
+}
+
+static struct log_ring *
+_ring_get(void)
+{
+	struct log_ring *ring;
+
+	if (_ring)
+		return _ring;
+
+	for (ring = atomic_load(&_rings); ring; ring = ring->next)
+	{
+		bool expected = false;
+
+		if (atomic_compare_exchange_strong(&ring->in_use, &expected, true))
+			break;
+	}
+
+	if (!ring)
+	{
+		ring = calloc(1, sizeof(*ring));
+		if (!ring)
+			return NULL;
+
+		atomic_init(&ring->in_use, true);
+		ring->next = atomic_load(&_rings);
+		while (!atomic_compare_exchange_weak(&_rings, &ring->next, ring))
+			;
+	}
+
+	ring->tid = gettid();
+	pthread_setspecific(_ring_key, ring);
+	_ring = ring;
+	return ring;
+}
+
+static size_t
+_drain(void)
+{
+	struct log_ring *ring;
+	unsigned long dropped;
+	size_t n = 0;
+
+	pthread_mutex_lock(&_drain_lock);
+
+	for (ring = atomic_load(&_rings); ring; ring = ring->next)
+	{
+		size_t tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+		size_t head = atomic_load_explicit(&ring->head, memory_order_acquire);
+
+		for (; tail != head; tail++, n++)
+		{
+			struct log_entry *e = &ring->entries[tail & (CONVERT_LOG_RING_SLOTS - 1)];
+			struct tm tm;
+			char date[16];
+
+			localtime_r(&e->ts.tv_sec, &tm);
+			strftime(date, sizeof(date), "%H:%M:%S", &tm);
+			fprintf(_log_fp, "%s.%03ld %-5s [%d] %s\n", date,
+					e->ts.tv_nsec / 1000000, _level_names[e->level], e->tid,
+					e->msg);
+		}
+
+		atomic_store_explicit(&ring->tail, tail, memory_order_release);
+	}
+
+	dropped = atomic_exchange(&_dropped, 0);
+	if (dropped)
+		fprintf(_log_fp, "%lu log messages dropped\n", dropped);
+
+	if (n || dropped)
+		fflush(_log_fp);
+
+	pthread_mutex_unlock(&_drain_lock);
+	return n;
+}
+
+static void *
+_drain_thread(void *arg)
+{
+	struct timespec pause = {0, CONVERT_LOG_DRAIN_MS * 1000000L};
+
+	(void)arg;
+
+	while (!atomic_load(&_drain_stop))
+		if (!_drain())
+			nanosleep(&pause, NULL);
+
+	return NULL;
+}
+
+static void
+_drain_start(void)
+{
+	pthread_t thread;
+	sigset_t all, old;
+
+	if (atomic_exchange(&_drain_started, true))
+		return;
+
+	/* leave the app's signals to the app's threads */
+	sigfillset(&all);
+	pthread_sigmask(SIG_SETMASK, &all, &old);
+
+	if (pthread_create(&thread, NULL, _drain_thread, NULL) == 0)
+		pthread_detach(thread);
+	else
+		atomic_store(&_drain_started, false);
+
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+}
+
+/* The drain thread does not survive fork(): the child starts its own on
+ * its first message. What the rings held before the fork is the parent's
+ * to write.
+ */
+static void
+_atfork_child(void)
+{
+	struct log_ring *ring;
+
+	pthread_mutex_init(&_drain_lock, NULL);
+	atomic_store(&_drain_started, false);
+
+	for (ring = atomic_load(&_rings); ring; ring = ring->next)
+		atomic_store(&ring->tail, atomic_load(&ring->head));
+
+	if (_ring)
+		_ring->tid = gettid();
+}
+
+void
+convert_log_write(int level, const char *file, int line, const char *fmt, ...)
+{
+	struct log_ring *ring;
+	struct log_entry *e;
+	const char *base;
+	size_t head, tail;
+	va_list ap;
+	int len;
+
+	if (!atomic_load_explicit(&_drain_started, memory_order_relaxed))
+		_drain_start();
+
+	ring = _ring_get();
+	if (!ring)
+	{
+		atomic_fetch_add(&_dropped, 1);
+		return;
+	}
+
+	head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+	tail = atomic_load_explicit(&ring->tail, memory_order_acquire);
+	if (head - tail >= CONVERT_LOG_RING_SLOTS)
+	{
+		atomic_fetch_add(&_dropped, 1);
+		return;
+	}
+
+	e = &ring->entries[head & (CONVERT_LOG_RING_SLOTS - 1)];
+	clock_gettime(CLOCK_REALTIME, &e->ts);
+	e->level = level;
+	e->tid = ring->tid;
+
+	base = strrchr(file, '/');
+	len = snprintf(e->msg, sizeof(e->msg), "%s:%d: ", base ? base + 1 : file,
+				   line);
+	if (len < 0 || (size_t)len >= sizeof(e->msg))
+		len = 0;
+
+	va_start(ap, fmt);
+	vsnprintf(e->msg + len, sizeof(e->msg) - len, fmt, ap);
+	va_end(ap);
+
+	atomic_store_explicit(&ring->head, head + 1, memory_order_release);
+}
+
+static int
+_parse_level(const char *level)
+{
+	size_t i;
+
+	if (!level)
+		return CONVERT_LOG_INFO;
+
+	for (i = 0; i < sizeof(_level_names) / sizeof(_level_names[0]); i++)
+		if (strcasecmp(level, _level_names[i]) == 0)
+			return i;
+
+	return CONVERT_LOG_INFO;
+}
+
+int
+convert_log_init(const char *path, const char *level)
+{
+	if (!path)
+		return 0;
+
+	/* several preloaded processes may share the file */
+	_log_fp = fopen(path, "a");
+	if (!_log_fp)
+		return -1;
+
+	if (pthread_key_create(&_ring_key, _ring_release) != 0)
+	{
+		fclose(_log_fp);
+		_log_fp = NULL;
+		return -1;
+	}
+
+	pthread_atfork(NULL, NULL, _atfork_child);
+
+	convert_log_level = _parse_level(level);
+	return 0;
+}
+
+void
+convert_log_fini(void)
+{
+	if (!_log_fp)
+		return;
+
+	atomic_store(&_drain_stop, true);
+	_drain();
+
+	/* the drain thread may still be running: keep the file open */
+	convert_log_level = CONVERT_LOG_OFF;
+}
@@ -0,0 +1,89 @@
+/**
+ * Copyright(c) 2019, Tessares S.A.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ * list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and / or other materials provided with the distribution.
+ *
+ * 3. Neither the name of the copyright holder nor the names of its
+ * contributors may be used to endorse or promote products derived from
+ * this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED.IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ *        SERVICES; LOSS OF USE, DATA, OR PROFITS;
+ *        OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT(INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/* Leveled logging for the interception library.
+ *
+ * A log call formats its message into a ring owned by the calling thread,
+ * without taking a lock or making a syscall. A background thread drains
+ * the rings to the CONVERT_LOG file. Levels below CONVERT_LOG_LEVEL are
+ * compiled out; when CONVERT_LOG is not set, a log call costs a single
+ * load and branch and its arguments are not evaluated.
+ */
+
+#ifndef _CONVERT_LOG_H_
+#define _CONVERT_LOG_H_
+
+enum
+{
+	CONVERT_LOG_TRACE = 0,
+	CONVERT_LOG_DEBUG,
+	CONVERT_LOG_INFO,
+	CONVERT_LOG_WARN,
+	CONVERT_LOG_ERROR,
+	CONVERT_LOG_OFF,
+};
+
+/* Lowest level compiled in. */
+#ifndef CONVERT_LOG_LEVEL
+#define CONVERT_LOG_LEVEL CONVERT_LOG_DEBUG
+#endif
+
+/* Lowest level written at runtime, CONVERT_LOG_OFF when logging is off. */
+extern int convert_log_level;
+
+void convert_log_write(int level, const char *file, int line,
+					   const char *fmt, ...)
+	__attribute__((format(printf, 4, 5)));
+
+#define convert_log(level, ...)                                   \
+	do                                                            \
+	{                                                             \
+		if ((level) >= CONVERT_LOG_LEVEL &&                       \
+			__builtin_expect((level) >= convert_log_level, 0))    \
+			convert_log_write(level, __FILE__, __LINE__, __VA_ARGS__); \
+	} while (0)
+
+#define log_trace(...) convert_log(CONVERT_LOG_TRACE, __VA_ARGS__)
+#define log_debug(...) convert_log(CONVERT_LOG_DEBUG, __VA_ARGS__)
+#define log_info(...) convert_log(CONVERT_LOG_INFO, __VA_ARGS__)
+#define log_warn(...) convert_log(CONVERT_LOG_WARN, __VA_ARGS__)
+#define log_error(...) convert_log(CONVERT_LOG_ERROR, __VA_ARGS__)
+
+/* Start logging to the file at path (nothing if NULL) from the given
+ * level name ("trace" to "error", "info" if NULL). Returns -1 if the file
+ * cannot be opened.
+ */
+int convert_log_init(const char *path, const char *level);
+
+/* Write out what is still buffered and stop logging. */
+void convert_log_fini(void);
+
+#endif
@@ -0,0 +1,619 @@
+/**
+ * Copyright(c) 2019, Tessares S.A.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ * list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and / or other materials provided with the distribution.
+ *
+ * 3. Neither the name of the copyright holder nor the names of its
+ * contributors may be used to endorse or promote products derived from
+ * this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED.IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ *        SERVICES; LOSS OF USE, DATA, OR PROFITS;
+ *        OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT(INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+/* Destination policy.
+ *
+ * CONVERT_POLICY names a file of rules, one per line:
+ *
+ *   # action   prefix            [port[-port]]  [profile]
+ *   direct     10.0.0.0/8
+ *   direct     fd00::/8
+ *   convert    0.0.0.0/0         443            bulk
+ *   bypass     198.51.100.0/24   8000-8999
+ *
+ * convert sends the connect through the converter, direct connects
+ * straight to the destination, and bypass converts until a converted
+ * connect matching the rule fails, then connects directly. The rule with
+ * the longest prefix matching the destination applies, the first one in
+ * the file among rules with the same prefix. Destinations matching no
+ * rule are converted.
+ *
+ * A profile tunes the sockets of the rules naming it, before they
+ * connect. It is declared before them as
+ *
+ *   profile bulk sndbuf=4194304 rcvbuf=4194304 cc=bbr
+ *   profile interactive nodelay=1 notsent_lowat=16384 abort_on_error=0
+ *
+ * with sndbuf, rcvbuf, nodelay and notsent_lowat setting the socket
+ * options of the same name, cc the congestion control, linger=<seconds>
+ * SO_LINGER, and abort_on_error=0 closing the connection to the
+ * converter gracefully instead of with a RST when the handshake fails.
+ *
+ * The prefixes are compiled into a binary trie over 128-bit addresses,
+ * IPv4 ones being mapped into ::ffff:0:0/96: a lookup walks at most 128
+ * nodes and does not allocate.
+ */
+
+#define _GNU_SOURCE
+#include <arpa/inet.h>
+#include <ctype.h>
+#include <errno.h>
+#include <netinet/tcp.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "convert_client.h"
+#include "convert_log.h"
+
+/* Integer socket options a profile may set. */
+static const struct
+{
+	const char *key;
+	int level;
+	int name;
+} _profile_opts[] = {
+	{"sndbuf", SOL_SOCKET, SO_SNDBUF},
+	{"rcvbuf", SOL_SOCKET, SO_RCVBUF},
+	{"nodelay", SOL_TCP, TCP_NODELAY},
+	{"notsent_lowat", SOL_TCP, TCP_NOTSENT_LOWAT},
+};
+
+#define CONVERT_PROFILE_OPTS (sizeof(_profile_opts) / sizeof(_profile_opts[0]))
+/* as TCP_CA_NAME_MAX */
+#define CONVERT_CC_NAME_MAX 16
+
+struct policy_profile
+{
+	char name[32];
+	int opts[CONVERT_PROFILE_OPTS];
+	/* bit i set when opts[i] is */
+	unsigned int opts_set;
+	char cc[CONVERT_CC_NAME_MAX];
+	/* SO_LINGER timeout in seconds, -1 if not set */
+	int linger;
+	bool abort_on_error;
+};
+
+struct policy_rule
+{
+	int action;
+	/* profile applied to the sockets, -1 if none */
+	int profile;
+	uint16_t port_min;
+	uint16_t port_max;
+	/* next rule with the same prefix, -1 if none */
+	int next;
+	int line;
+	/* bypass rule whose converted connect failed */
+	atomic_bool failed;
+};
+
+struct policy_node
+{
+	/* children for a 0 and a 1 bit, 0 if none (the root is never one) */
+	int child[2];
+	/* first rule of this prefix, -1 if none */
+	int rules;
+};
+
+static struct policy_rule *_rules;
+static int _rule_count;
+static struct policy_node *_nodes;
+static int _node_count;
+static struct policy_profile *_profiles;
+static int _profile_count;
+
+static int
+_add_node(void)
+{
+	static int capacity;
+
+	if (_node_count == capacity)
+	{
+		int size = capacity ? capacity * 2 : 256;
+		struct policy_node *nodes = realloc(_nodes, size * sizeof(*nodes));
+
+		if (!nodes)
+			return -1;
+		_nodes = nodes;
+		capacity = size;
+	}
+
+	_nodes[_node_count] = (struct policy_node){.rules = -1};
+	return _node_count++;
+}
+
+static int
+_add_rule(const struct in6_addr *prefix, int len, const struct policy_rule *rule)
+{
+	static int capacity;
+	int node = 0;
+	int *last;
+	int bit;
+
+	for (bit = 0; bit < len; bit++)
+	{
+		int b = (prefix->s6_addr[bit / 8] >> (7 - bit % 8)) & 1;
+
+		if (!_nodes[node].child[b])
+		{
+			int child = _add_node();
+
+			if (child < 0)
+				return -1;
+			_nodes[node].child[b] = child;
+		}
+		node = _nodes[node].child[b];
+	}
+
+	if (_rule_count == capacity)
+	{
+		int size = capacity ? capacity * 2 : 32;
+		struct policy_rule *rules = realloc(_rules, size * sizeof(*rules));
+
+		if (!rules)
+			return -1;
+		_rules = rules;
+		capacity = size;
+	}
+
+	_rules[_rule_count] = *rule;
+	_rules[_rule_count].next = -1;
+
+	/* keep the file order among rules of the same prefix */
+	for (last = &_nodes[node].rules; *last >= 0; last = &_rules[*last].next)
+		;
+	*last = _rule_count++;
+	return 0;
+}
+
+static int
+_parse_action(const char *word)
+{
+	if (strcmp(word, "convert") == 0)
+		return CONVERT_POLICY_CONVERT;
+	if (strcmp(word, "direct") == 0)
+		return CONVERT_POLICY_DIRECT;
+	if (strcmp(word, "bypass") == 0)
+		return CONVERT_POLICY_BYPASS;
+	return -1;
+}
+
+/* Parse "addr[/len]" into a prefix of the 128-bit space. */
+static int
+_parse_prefix(const char *word, struct in6_addr *prefix, int *len)
+{
+	const char *slash = strchr(word, '/');
+	char addr[INET6_ADDRSTRLEN];
+	struct in_addr in;
+	int max;
+
+	snprintf(addr, sizeof(addr), "%.*s",
+			 slash ? (int)(slash - word) : (int)strlen(word), word);
+	if (slash)
+		slash++;
+
+	if (inet_pton(AF_INET, addr, &in) == 1)
+	{
+		*prefix = (struct in6_addr){
+			.s6_addr32 = {0, 0, htonl(0xffff), in.s_addr},
+		};
+		max = 32;
+	}
+	else if (inet_pton(AF_INET6, addr, prefix) == 1)
+		max = 128;
+	else
+		return -1;
+
+	*len = max;
+	if (slash)
+	{
+		char *endp;
+
+		*len = strtol(slash, &endp, 10);
+		if (*endp || endp == slash || *len < 0 || *len > max)
+			return -1;
+	}
+
+	*len += 128 - max;
+	return 0;
+}
+
+/* Parse "port" or "port-port". */
+static int
+_parse_ports(char *word, struct policy_rule *rule)
+{
+	char *endp;
+	long min, max;
+
+	min = strtol(word, &endp, 10);
+	max = min;
+	if (*endp == '-')
+		max = strtol(endp + 1, &endp, 10);
+
+	if (*endp || min < 0 || max > 65535 || min > max)
+		return -1;
+
+	rule->port_min = min;
+	rule->port_max = max;
+	return 0;
+}
+
+static int
+_find_profile(const char *name)
+{
+	int i;
+
+	for (i = 0; i < _profile_count; i++)
+		if (strcmp(_profiles[i].name, name) == 0)
+			return i;
+	return -1;
+}
+
+/* Parse one "key=value" setting of a profile. */
+static int
+_parse_setting(struct policy_profile *profile, char *word)
+{
+	char *value = strchr(word, '=');
+	char *endp;
+	long n;
+	size_t i;
+
+	if (!value)
+		return -1;
+	*value++ = '\0';
+
+	if (strcmp(word, "cc") == 0)
+	{
+		if (!*value || strlen(value) >= sizeof(profile->cc))
+			return -1;
+		strcpy(profile->cc, value);
+		return 0;
+	}
+
+	n = strtol(value, &endp, 10);
+	if (*endp || endp == value || n < 0 || n > INT32_MAX)
+		return -1;
+
+	if (strcmp(word, "linger") == 0)
+	{
+		profile->linger = n;
+		return 0;
+	}
+
+	if (strcmp(word, "abort_on_error") == 0)
+	{
+		profile->abort_on_error = n != 0;
+		return 0;
+	}
+
+	for (i = 0; i < CONVERT_PROFILE_OPTS; i++)
+		if (strcmp(word, _profile_opts[i].key) == 0)
+		{
+			profile->opts[i] = n;
+			profile->opts_set |= 1u << i;
+			return 0;
+		}
+
+	return -1;
+}
+
+static int
+_parse_profile(char **words, int count, int lineno)
+{
+	struct policy_profile profile = {
+		.linger = -1,
+		.abort_on_error = true,
+	};
+	struct policy_profile *profiles;
+	int i;
+
+	if (count < 2 || strlen(words[1]) >= sizeof(profile.name) ||
+		_find_profile(words[1]) >= 0)
+	{
+		log_error("policy line %d: expected a new profile name", lineno);
+		return -1;
+	}
+	strcpy(profile.name, words[1]);
+
+	for (i = 2; i < count; i++)
+		if (_parse_setting(&profile, words[i]) < 0)
+		{
+			log_error("policy line %d: invalid setting '%s'", lineno,
+					  words[i]);
+			return -1;
+		}
+
+	profiles = realloc(_profiles, (_profile_count + 1) * sizeof(*profiles));
+	if (!profiles)
+		return -1;
+	_profiles = profiles;
+	_profiles[_profile_count++] = profile;
+	return 0;
+}
+
+/* words per line: a profile may set each of its settings */
+#define CONVERT_POLICY_WORDS (int)(2 + CONVERT_PROFILE_OPTS + 3)
+
+static int
+_parse_line(char *line, int lineno)
+{
+	struct policy_rule rule = {
+		.profile = -1,
+		.port_max = 65535,
+		.line = lineno,
+	};
+	char *words[CONVERT_POLICY_WORDS + 1];
+	char *saveptr = NULL;
+	struct in6_addr prefix;
+	int count = 0;
+	int len;
+	char *word;
+
+	line[strcspn(line, "#\n")] = '\0';
+
+	for (word = strtok_r(line, " \t", &saveptr);
+		 word && count <= CONVERT_POLICY_WORDS;
+		 word = strtok_r(NULL, " \t", &saveptr))
+		words[count++] = word;
+
+	if (count == 0)
+		return 0;
+
+	if (count > CONVERT_POLICY_WORDS)
+	{
+		log_error("policy line %d: too many words", lineno);
+		return -1;
+	}
+
+	if (strcmp(words[0], "profile") == 0)
+		return _parse_profile(words, count, lineno);
+
+	if (count > 2 && !isdigit((unsigned char)*words[count - 1]))
+	{
+		/* ports start with a digit, profile names do not */
+		rule.profile = _find_profile(words[count - 1]);
+		if (rule.profile < 0)
+		{
+			log_error("policy line %d: unknown profile '%s'", lineno,
+					  words[count - 1]);
+			return -1;
+		}
+		count--;
+	}
+
+	if (count < 2 || count > 3)
+	{
+		log_error("policy line %d: expected an action, a prefix, optional "
+				  "ports and an optional profile", lineno);
+		return -1;
+	}
+
+	rule.action = _parse_action(words[0]);
+	if (rule.action < 0)
+	{
+		log_error("policy line %d: unknown action '%s'", lineno, words[0]);
+		return -1;
+	}
+
+	if (_parse_prefix(words[1], &prefix, &len) < 0)
+	{
+		log_error("policy line %d: invalid prefix '%s'", lineno, words[1]);
+		return -1;
+	}
+
+	if (count == 3 && _parse_ports(words[2], &rule) < 0)
+	{
+		log_error("policy line %d: invalid ports '%s'", lineno, words[2]);
+		return -1;
+	}
+
+	return _add_rule(&prefix, len, &rule);
+}
+
+int
+convert_policy_load(const char *path)
+{
+	char line[256];
+	int lineno = 0;
+	FILE *fp;
+
+	fp = fopen(path, "re");
+	if (!fp)
+	{
+		log_error("unable to open policy %s: %s", path, strerror(errno));
+		return -1;
+	}
+
+	/* the root */
+	if (_add_node() < 0)
+	{
+		fclose(fp);
+		return -1;
+	}
+
+	while (fgets(line, sizeof(line), fp))
+	{
+		if (!strchr(line, '\n') && !feof(fp))
+		{
+			log_error("policy line %d: too long", lineno + 1);
+			fclose(fp);
+			return -1;
+		}
+
+		if (_parse_line(line, ++lineno) < 0)
+		{
+			fclose(fp);
+			return -1;
+		}
+	}
+
+	fclose(fp);
+
+	log_info("loaded %d policy rules and %d profiles from %s", _rule_count,
+			 _profile_count, path);
+	return 0;
+}
+
+/* First rule of the node matching port, -1 if none. */
+static int
+_node_match(const struct policy_node *node, uint16_t port)
+{
+	int i;
+
+	for (i = node->rules; i >= 0; i = _rules[i].next)
+		if (port >= _rules[i].port_min && port <= _rules[i].port_max)
+			return i;
+	return -1;
+}
+
+int
+convert_policy_lookup(const struct sockaddr *addr, int *rule)
+{
+	struct in6_addr key;
+	uint16_t port;
+	int match = -1;
+	int node = 0;
+	int bit;
+
+	*rule = -1;
+	if (!_nodes)
+		return CONVERT_POLICY_CONVERT;
+
+	switch (addr->sa_family)
+	{
+	case AF_INET:
+	{
+		const struct sockaddr_in *in = (const struct sockaddr_in *)addr;
+
+		key = (struct in6_addr){
+			.s6_addr32 = {0, 0, htonl(0xffff), in->sin_addr.s_addr},
+		};
+		port = ntohs(in->sin_port);
+		break;
+	}
+	case AF_INET6:
+	{
+		const struct sockaddr_in6 *in6 = (const struct sockaddr_in6 *)addr;
+
+		key = in6->sin6_addr;
+		port = ntohs(in6->sin6_port);
+		break;
+	}
+	default:
+		return CONVERT_POLICY_CONVERT;
+	}
+
+	/* the deepest node with a rule for the port wins */
+	for (bit = 0;; bit++)
+	{
+		int m = _node_match(&_nodes[node], port);
+
+		if (m >= 0)
+			match = m;
+
+		if (bit == 128)
+			break;
+
+		node = _nodes[node].child[(key.s6_addr[bit / 8] >> (7 - bit % 8)) & 1];
+		if (!node)
+			break;
+	}
+
+	if (match < 0)
+		return CONVERT_POLICY_CONVERT;
+
+	*rule = match;
+	switch (_rules[match].action)
+	{
+	case CONVERT_POLICY_BYPASS:
+		return atomic_load_explicit(&_rules[match].failed,
+									memory_order_relaxed)
+				   ? CONVERT_POLICY_DIRECT
+				   : CONVERT_POLICY_CONVERT;
+	default:
+		return _rules[match].action;
+	}
+}
+
+void
+convert_policy_failed(int rule)
+{
+	if (rule < 0 || _rules[rule].action != CONVERT_POLICY_BYPASS)
+		return;
+
+	if (!atomic_exchange(&_rules[rule].failed, true))
+		log_warn("converter failed for policy line %d, bypassing it",
+				 _rules[rule].line);
+}
+
+void
+convert_policy_tune(int rule, int fd)
+{
+	const struct policy_profile *profile;
+	size_t i;
+
+	if (rule < 0 || _rules[rule].profile < 0)
+		return;
+
+	profile = &_profiles[_rules[rule].profile];
+
+	for (i = 0; i < CONVERT_PROFILE_OPTS; i++)
+		if ((profile->opts_set & (1u << i)) &&
+			setsockopt(fd, _profile_opts[i].level, _profile_opts[i].name,
+					   &profile->opts[i], sizeof(profile->opts[i])) < 0)
+			log_debug("fd %d: unable to set %s: %s", fd, _profile_opts[i].key,
+					  strerror(errno));
+
+	if (profile->cc[0] &&
+		setsockopt(fd, SOL_TCP, TCP_CONGESTION, profile->cc,
+				   strlen(profile->cc)) < 0)
+		log_debug("fd %d: unable to use congestion control %s: %s", fd,
+				  profile->cc, strerror(errno));
+
+	if (profile->linger >= 0)
+	{
+		struct linger linger = {1, profile->linger};
+
+		setsockopt(fd, SOL_SOCKET, SO_LINGER, &linger, sizeof(linger));
+	}
+}
+
+bool
+convert_policy_abort_on_error(int rule)
+{
+	if (rule < 0 || _rules[rule].profile < 0)
+		return true;
+
+	return _profiles[_rules[rule].profile].abort_on_error;
+}
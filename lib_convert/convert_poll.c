@@ -0,0 +1,775 @@
+/**
+ * Copyright(c) 2019, Tessares S.A.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ * list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and / or other materials provided with the distribution.
+ *
+ * 3. Neither the name of the copyright holder nor the names of its
+ * contributors may be used to endorse or promote products derived from
+ * this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED.IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ *        SERVICES; LOSS OF USE, DATA, OR PROFITS;
+ *        OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT(INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/* Readiness interception for managed sockets.
+ *
+ * While the Convert handshake of a socket is pending, the kernel reports
+ * readiness for the handshake (the converter accepted the connection,
+ * the CONNECT TLV can be written, the reply arrived), not for the app.
+ * poll(), select() and epoll wait on the events the handshake needs
+ * instead, advance it when they fire, and only report to the app what
+ * it can act upon: writability once connect() would have succeeded,
+ * readability for app data, and errors.
+ */
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "convert_client.h"
+
+/* Tag in the epoll_data of our own registrations, with the fd in the low
+ * bits. The app's data may look the same: see _epoll_ours().
+ */
+#define CONVERT_EPOLL_TAG 0xc0de000000000000ULL
+#define CONVERT_EPOLL_TAG_MASK 0xffffffff00000000ULL
+
+/* epoll input flags that are not readiness events */
+#define CONVERT_EPOLL_FLAGS \
+	(EPOLLET | EPOLLONESHOT | EPOLLWAKEUP | EPOLLEXCLUSIVE)
+
+#define POLL_STACK_LEN 64
+
+/* Managed sockets registered in an epoll set that are ready without the
+ * kernel knowing: buffered app data, or a failed handshake.
+ */
+static socket_state_t *_ready_list;
+static pthread_mutex_t _ready_mutex = PTHREAD_MUTEX_INITIALIZER;
+static atomic_int _ready_count;
+
+/* Whether readiness of the socket differs from the kernel's. */
+static bool
+_hs_pending(const socket_state_t *state)
+{
+	switch (state->hs)
+	{
+	case CONVERT_HS_IDLE:
+		return false;
+	case CONVERT_HS_DONE:
+		return state->rx_off < state->rx_len;
+	default:
+		return true;
+	}
+}
+
+static bool
+_hs_ready_now(const socket_state_t *state)
+{
+	return state->hs == CONVERT_HS_ERROR ||
+		   (state->hs == CONVERT_HS_DONE && state->rx_off < state->rx_len);
+}
+
+/* Kernel events that advance the handshake of a socket on which the app
+ * waits for `events`.
+ */
+static uint32_t
+_hs_events(const socket_state_t *state, uint32_t events)
+{
+	switch (state->hs)
+	{
+	case CONVERT_HS_CONNECTING:
+	case CONVERT_HS_SEND_HDR:
+		return POLLOUT;
+	case CONVERT_HS_WAIT_REPLY:
+		/* with an optimistic connect the app may already write */
+		if (convert_connect_until() <= CONVERT_HS_WAIT_REPLY)
+			return POLLIN | (events & POLLOUT);
+		return POLLIN;
+	default:
+		return events;
+	}
+}
+
+/* The part of _hs_events() the handshake itself waits for, as opposed
+ * to events only reported to the app.
+ */
+static uint32_t
+_hs_driving_events(const socket_state_t *state, uint32_t events)
+{
+	int until = events & POLLIN ? CONVERT_HS_DONE : convert_connect_until();
+
+	switch (state->hs)
+	{
+	case CONVERT_HS_CONNECTING:
+		return POLLOUT;
+	case CONVERT_HS_SEND_HDR:
+		return state->hs < until ? POLLOUT : 0;
+	case CONVERT_HS_WAIT_REPLY:
+		return state->hs < until ? POLLIN : 0;
+	default:
+		return 0;
+	}
+}
+
+/* Advance the handshake on the kernel readiness `revents` and return the
+ * events to report to the app.
+ */
+static uint32_t
+_hs_revents(socket_state_t *state, uint32_t events, uint32_t revents)
+{
+	int until = events & POLLIN ? CONVERT_HS_DONE : convert_connect_until();
+	int hs = state->hs;
+	uint32_t ready = 0;
+
+	if (revents && hs != CONVERT_HS_IDLE && hs < until)
+		convert_handshake(state, until, MSG_DONTWAIT);
+
+	switch (state->hs)
+	{
+	case CONVERT_HS_IDLE:
+		return revents;
+	case CONVERT_HS_ERROR:
+		/* let the app collect the error from its next call */
+		return POLLERR | (events & (POLLIN | POLLOUT));
+	case CONVERT_HS_DONE:
+		if (state->rx_off < state->rx_len)
+			ready |= events & POLLIN;
+		/* revents only belong to the app if we waited on its events */
+		if (hs == CONVERT_HS_DONE)
+			ready |= revents;
+		return ready;
+	default:
+		if (state->hs >= convert_connect_until())
+			ready |= revents & events & POLLOUT;
+		return ready;
+	}
+}
+
+static void
+_deadline_init(struct timespec *deadline, int timeout)
+{
+	if (timeout <= 0)
+		return;
+
+	clock_gettime(CLOCK_MONOTONIC, deadline);
+	deadline->tv_sec += timeout / 1000;
+	deadline->tv_nsec += (timeout % 1000) * 1000000L;
+	if (deadline->tv_nsec >= 1000000000L)
+	{
+		deadline->tv_sec++;
+		deadline->tv_nsec -= 1000000000L;
+	}
+}
+
+/* Milliseconds left of `timeout` (rounded up), -1 for no timeout. */
+static int
+_deadline_left(const struct timespec *deadline, int timeout)
+{
+	struct timespec now;
+	long ms;
+
+	if (timeout <= 0)
+		return timeout;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	ms = (deadline->tv_sec - now.tv_sec) * 1000 +
+		 (deadline->tv_nsec - now.tv_nsec + 999999L) / 1000000L;
+	return ms > 0 ? (int)ms : 0;
+}
+
+static int
+_poll(struct pollfd *fds, nfds_t nfds, int timeout)
+{
+	struct saved
+	{
+		nfds_t i;
+		short events;
+	} stack[POLL_STACK_LEN], *saved = stack;
+	size_t cap = POLL_STACK_LEN;
+	struct timespec deadline;
+	int left = timeout;
+	int ret;
+
+	_deadline_init(&deadline, timeout);
+
+	for (;;)
+	{
+		int wait = left;
+		size_t n = 0;
+		size_t j = 0;
+		nfds_t i;
+
+		for (i = 0; i < nfds; i++)
+		{
+			socket_state_t *state = convert_lookup(fds[i].fd);
+
+			if (!state || !_hs_pending(state))
+				continue;
+
+			if (n == cap)
+			{
+				struct saved *grown;
+
+				grown = malloc(2 * cap * sizeof(*saved));
+				if (!grown)
+					/* the remaining sockets are not translated */
+					break;
+				memcpy(grown, saved, n * sizeof(*saved));
+				if (saved != stack)
+					free(saved);
+				saved = grown;
+				cap *= 2;
+			}
+
+			saved[n].i = i;
+			saved[n].events = fds[i].events;
+			n++;
+
+			if (_hs_ready_now(state))
+				wait = 0;
+			fds[i].events = _hs_events(state, fds[i].events);
+		}
+
+		ret = SYS(poll)(fds, nfds, wait);
+
+		for (i = 0; i < nfds && j < n; i++)
+		{
+			socket_state_t *state;
+
+			if (saved[j].i != i)
+				continue;
+
+			fds[i].events = saved[j].events;
+			j++;
+
+			state = convert_lookup(fds[i].fd);
+			if (ret < 0 || !state)
+				continue;
+
+			fds[i].revents = _hs_revents(state, fds[i].events,
+										 fds[i].revents);
+		}
+
+		if (ret < 0 || n == 0)
+			break;
+
+		for (ret = 0, i = 0; i < nfds; i++)
+			ret += fds[i].revents != 0;
+
+		if (ret || timeout == 0)
+			break;
+
+		left = _deadline_left(&deadline, timeout);
+		if (left == 0)
+			break;
+	}
+
+	if (saved != stack)
+		free(saved);
+
+	return ret;
+}
+
+int
+poll(struct pollfd *fds, nfds_t nfds, int timeout)
+{
+	if (!atomic_load_explicit(&convert_socket_count, memory_order_relaxed))
+		return SYS(poll)(fds, nfds, timeout);
+
+	return _poll(fds, nfds, timeout);
+}
+
+/* Like Linux select(), leave in timeout the time that was not slept
+ * since start.
+ */
+static void
+_select_left(struct timeval *timeout, const struct timespec *start)
+{
+	struct timespec now;
+	long long left;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	left = (long long)timeout->tv_sec * 1000000 + timeout->tv_usec -
+		   (now.tv_sec - start->tv_sec) * 1000000LL -
+		   (now.tv_nsec - start->tv_nsec) / 1000;
+	if (left < 0)
+		left = 0;
+
+	timeout->tv_sec = left / 1000000;
+	timeout->tv_usec = left % 1000000;
+}
+
+int
+select(int nfds, fd_set *readfds, fd_set *writefds, fd_set *exceptfds,
+	   struct timeval *timeout)
+{
+	struct pollfd pfds[FD_SETSIZE];
+	struct timespec start;
+	bool pending = false;
+	nfds_t n = 0;
+	int ms = -1;
+	int ret;
+	int fd;
+
+	if (!atomic_load_explicit(&convert_socket_count, memory_order_relaxed) ||
+		nfds > FD_SETSIZE)
+		return SYS(select)(nfds, readfds, writefds, exceptfds, timeout);
+
+	for (fd = 0; fd < nfds; fd++)
+	{
+		short events = 0;
+		socket_state_t *state;
+
+		if (readfds && FD_ISSET(fd, readfds))
+			events |= POLLIN;
+		if (writefds && FD_ISSET(fd, writefds))
+			events |= POLLOUT;
+		if (exceptfds && FD_ISSET(fd, exceptfds))
+			events |= POLLPRI;
+		if (!events)
+			continue;
+
+		state = convert_lookup(fd);
+		if (state && _hs_pending(state))
+			pending = true;
+
+		pfds[n++] = (struct pollfd){.fd = fd, .events = events};
+	}
+
+	/* nothing to translate */
+	if (!pending)
+		return SYS(select)(nfds, readfds, writefds, exceptfds, timeout);
+
+	if (timeout)
+	{
+		ms = timeout->tv_sec * 1000 + (timeout->tv_usec + 999) / 1000;
+		clock_gettime(CLOCK_MONOTONIC, &start);
+	}
+
+	ret = _poll(pfds, n, ms);
+	if (timeout)
+		_select_left(timeout, &start);
+	if (ret < 0)
+		return ret;
+
+	if (readfds)
+		FD_ZERO(readfds);
+	if (writefds)
+		FD_ZERO(writefds);
+	if (exceptfds)
+		FD_ZERO(exceptfds);
+
+	for (ret = 0; n-- > 0;)
+	{
+		struct pollfd *pfd = &pfds[n];
+
+		if (pfd->revents & POLLNVAL)
+		{
+			errno = EBADF;
+			return -1;
+		}
+
+		if ((pfd->events & POLLIN) &&
+			(pfd->revents & (POLLIN | POLLHUP | POLLERR)))
+		{
+			FD_SET(pfd->fd, readfds);
+			ret++;
+		}
+		if ((pfd->events & POLLOUT) && (pfd->revents & (POLLOUT | POLLERR)))
+		{
+			FD_SET(pfd->fd, writefds);
+			ret++;
+		}
+		if ((pfd->events & POLLPRI) && (pfd->revents & POLLPRI))
+		{
+			FD_SET(pfd->fd, exceptfds);
+			ret++;
+		}
+	}
+
+	return ret;
+}
+
+static void
+_ready_add(socket_state_t *state)
+{
+	pthread_mutex_lock(&_ready_mutex);
+	if (!state->ep_listed)
+	{
+		state->ep_next = _ready_list;
+		_ready_list = state;
+		state->ep_listed = true;
+		atomic_fetch_add(&_ready_count, 1);
+	}
+	pthread_mutex_unlock(&_ready_mutex);
+}
+
+static void
+_ready_remove(socket_state_t *state)
+{
+	socket_state_t **it;
+
+	if (!state->ep_listed)
+		return;
+
+	pthread_mutex_lock(&_ready_mutex);
+	for (it = &_ready_list; *it; it = &(*it)->ep_next)
+	{
+		if (*it == state)
+		{
+			*it = state->ep_next;
+			state->ep_listed = false;
+			atomic_fetch_sub(&_ready_count, 1);
+			break;
+		}
+	}
+	pthread_mutex_unlock(&_ready_mutex);
+}
+
+/* Events `ready` reported for the app's registration. Returns 0 if the
+ * app's EPOLLONESHOT already fired, or if its EPOLLET was told about
+ * all of them already. Threads waiting on the same epoll set race for
+ * the report: only one of them gets it.
+ */
+static uint32_t
+_epoll_report(socket_state_t *state, uint32_t ready)
+{
+	uint32_t reported = 0;
+
+	if (!ready)
+		return 0;
+
+	if (state->ep_event.events & EPOLLONESHOT)
+	{
+		if (!atomic_compare_exchange_strong(&state->ep_reported, &reported,
+											ready))
+			return 0;
+	}
+	else if (state->ep_event.events & EPOLLET)
+	{
+		reported = atomic_fetch_or(&state->ep_reported, ready);
+		if (!(ready & ~reported))
+			return 0;
+	}
+
+	return ready;
+}
+
+/* Kernel events of our registration for an app that waits for `events`.
+ * Once an EPOLLET/EPOLLONESHOT app was told, waiting for the same
+ * events again would only wake epoll_wait() up for reports it drops:
+ * keep what the handshake waits for, and make the rest edge-triggered.
+ */
+static uint32_t
+_epoll_kevents(const socket_state_t *state, uint32_t events)
+{
+	uint32_t kevents = _hs_events(state, events);
+	uint32_t reported = atomic_load(&state->ep_reported);
+	uint32_t driving;
+
+	if (!(state->ep_event.events & (EPOLLET | EPOLLONESHOT)) || !reported)
+		return kevents;
+
+	driving = _hs_driving_events(state, events);
+	if (state->ep_event.events & EPOLLONESHOT)
+		kevents &= driving;
+	else
+		kevents &= ~(reported & ~driving);
+
+	return driving ? kevents : kevents | EPOLLET;
+}
+
+void
+convert_epoll_sync(socket_state_t *state)
+{
+	struct epoll_event ev;
+	bool tagged;
+
+	if (state->ep_fd < 0)
+		return;
+
+	tagged = _hs_pending(state);
+	if (tagged)
+	{
+		ev.events = _epoll_kevents(state,
+								   state->ep_event.events & ~CONVERT_EPOLL_FLAGS);
+		ev.data.u64 = CONVERT_EPOLL_TAG | (uint32_t)state->fd;
+	}
+	else
+		ev = state->ep_event;
+
+	if (tagged != state->ep_tagged || (tagged && ev.events != state->ep_kevents))
+	{
+		SYS(epoll_ctl)(state->ep_fd, EPOLL_CTL_MOD, state->fd, &ev);
+		state->ep_tagged = tagged;
+		state->ep_kevents = ev.events;
+		if (tagged)
+			state->ep_tag_fd = state->ep_fd;
+	}
+
+	/* no kernel event will announce these */
+	if (_hs_ready_now(state))
+		_ready_add(state);
+	else
+		_ready_remove(state);
+}
+
+void
+convert_epoll_release(socket_state_t *state, bool restore_app)
+{
+	if (state->ep_fd < 0)
+		return;
+
+	_ready_remove(state);
+
+	if (restore_app && state->ep_tagged)
+		SYS(epoll_ctl)(state->ep_fd, EPOLL_CTL_MOD, state->fd,
+					   &state->ep_event);
+
+	state->ep_fd = -1;
+	state->ep_tagged = false;
+}
+
+void
+convert_epoll_moved(socket_state_t *state)
+{
+	if (state->ep_fd < 0)
+		return;
+
+	SYS(epoll_ctl)(state->ep_fd, EPOLL_CTL_ADD, state->fd, &state->ep_event);
+	state->ep_tagged = false;
+	state->ep_tag_fd = -1;
+	state->ep_kevents = 0;
+}
+
+int
+epoll_ctl(int epfd, int op, int fd, struct epoll_event *event)
+{
+	socket_state_t *state = convert_lookup(fd);
+	int ret;
+
+	if (!state)
+		return SYS(epoll_ctl)(epfd, op, fd, event);
+
+	switch (op)
+	{
+	case EPOLL_CTL_ADD:
+		/* only the first epoll set gets its readiness translated */
+		if (state->ep_fd >= 0 || !event)
+			break;
+
+		ret = SYS(epoll_ctl)(epfd, op, fd, event);
+		if (ret == 0)
+		{
+			state->ep_fd = epfd;
+			state->ep_event = *event;
+			state->ep_tagged = false;
+			state->ep_tag_fd = -1;
+			atomic_store(&state->ep_reported, 0);
+			convert_epoll_sync(state);
+		}
+		return ret;
+	case EPOLL_CTL_MOD:
+		if (state->ep_fd != epfd || !event)
+			break;
+
+		state->ep_event = *event;
+		atomic_store(&state->ep_reported, 0);
+
+		if (state->ep_tagged)
+		{
+			/* re-register ours, derived from the new events */
+			state->ep_kevents = 0;
+			convert_epoll_sync(state);
+			return 0;
+		}
+
+		ret = SYS(epoll_ctl)(epfd, op, fd, event);
+		if (ret == 0)
+			convert_epoll_sync(state);
+		return ret;
+	case EPOLL_CTL_DEL:
+		if (state->ep_fd == epfd)
+			convert_epoll_release(state, false);
+		if (state->ep_tag_fd == epfd)
+			state->ep_tag_fd = -1;
+		break;
+	}
+
+	return SYS(epoll_ctl)(epfd, op, fd, event);
+}
+
+/* The state whose registration of ours in epfd reported `ev`, NULL if
+ * the event is the app's. The app's own data may carry our tag too: the
+ * fd must be one we registered in epfd. Released states count, as ours
+ * may have been handed back to the app since the kernel reported it.
+ */
+static socket_state_t *
+_epoll_ours(int epfd, const struct epoll_event *ev)
+{
+	uint32_t fd = (uint32_t)ev->data.u64;
+	socket_state_t *state;
+
+	if ((ev->data.u64 & CONVERT_EPOLL_TAG_MASK) != CONVERT_EPOLL_TAG ||
+		fd >= convert_socket_table_size)
+		return NULL;
+
+	state = atomic_load_explicit(&convert_socket_table[fd],
+								 memory_order_acquire);
+	if (!state || state->ep_tag_fd != epfd)
+		return NULL;
+
+	return state;
+}
+
+/* Report the ready list entries of epfd. */
+static int
+_epoll_collect(int epfd, struct epoll_event *events, int maxevents)
+{
+	socket_state_t *state;
+	int n = 0;
+
+	pthread_mutex_lock(&_ready_mutex);
+	for (state = _ready_list; state && n < maxevents; state = state->ep_next)
+	{
+		uint32_t ready;
+
+		if (state->ep_fd != epfd)
+			continue;
+
+		ready = _hs_revents(state,
+							state->ep_event.events & ~CONVERT_EPOLL_FLAGS, 0);
+		ready = _epoll_report(state, ready);
+		if (!ready)
+			continue;
+
+		events[n].events = ready;
+		events[n].data = state->ep_event.data;
+		n++;
+	}
+	pthread_mutex_unlock(&_ready_mutex);
+
+	return n;
+}
+
+static int
+_epoll_wait(int epfd, struct epoll_event *events, int maxevents, int timeout,
+			const sigset_t *sigmask)
+{
+	struct timespec deadline;
+	int left = timeout;
+
+	_deadline_init(&deadline, timeout);
+
+	for (;;)
+	{
+		int collected = 0;
+		int ret = 0;
+		int i, k;
+
+		if (atomic_load_explicit(&_ready_count, memory_order_relaxed))
+			collected = _epoll_collect(epfd, events, maxevents);
+
+		if (collected < maxevents)
+		{
+			int wait = collected ? 0 : left;
+
+			if (sigmask)
+				ret = SYS(epoll_pwait)(epfd, events + collected,
+									   maxevents - collected, wait, sigmask);
+			else
+				ret = SYS(epoll_wait)(epfd, events + collected,
+									  maxevents - collected, wait);
+			if (ret < 0)
+				return collected ? collected : ret;
+		}
+
+		/* translate the events of our own registrations */
+		for (k = i = collected; i < collected + ret; i++)
+		{
+			struct epoll_event *ev = &events[i];
+			socket_state_t *state;
+			uint32_t ready;
+
+			state = _epoll_ours(epfd, ev);
+			if (!state)
+			{
+				events[k++] = *ev;
+				continue;
+			}
+
+			/* stale: the app's registration is back and reports on its
+			 * own. Or already reported from the ready list.
+			 */
+			if (atomic_load_explicit(&state->released, memory_order_acquire) ||
+				!state->ep_tagged || state->ep_fd != epfd ||
+				(collected && state->ep_listed))
+				continue;
+
+			ready = _hs_revents(state,
+								state->ep_event.events & ~CONVERT_EPOLL_FLAGS,
+								ev->events);
+			ready = _epoll_report(state, ready);
+			/* stop our registration from repeating what the app was told */
+			if ((state->ep_event.events & (EPOLLET | EPOLLONESHOT)) &&
+				pthread_mutex_trylock(&state->lock) == 0)
+			{
+				convert_epoll_sync(state);
+				pthread_mutex_unlock(&state->lock);
+			}
+			if (!ready)
+				continue;
+
+			ev->events = ready;
+			ev->data = state->ep_event.data;
+			events[k++] = *ev;
+		}
+
+		if (k || timeout == 0)
+			return k;
+
+		left = _deadline_left(&deadline, timeout);
+		if (left == 0)
+			return 0;
+	}
+}
+
+int
+epoll_wait(int epfd, struct epoll_event *events, int maxevents, int timeout)
+{
+	if (!atomic_load_explicit(&convert_socket_count, memory_order_relaxed))
+		return SYS(epoll_wait)(epfd, events, maxevents, timeout);
+
+	return _epoll_wait(epfd, events, maxevents, timeout, NULL);
+}
+
+int
+epoll_pwait(int epfd, struct epoll_event *events, int maxevents, int timeout,
+			const sigset_t *sigmask)
+{
+	if (!atomic_load_explicit(&convert_socket_count, memory_order_relaxed))
+		return SYS(epoll_pwait)(epfd, events, maxevents, timeout, sigmask);
+
+	return _epoll_wait(epfd, events, maxevents, timeout, sigmask);
+}
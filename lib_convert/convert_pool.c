@@ -0,0 +1,354 @@
+/**
+ * Copyright(c) 2019, Tessares S.A.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ * list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and / or other materials provided with the distribution.
+ *
+ * 3. Neither the name of the copyright holder nor the names of its
+ * contributors may be used to endorse or promote products derived from
+ * this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED.IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ *        SERVICES; LOSS OF USE, DATA, OR PROFITS;
+ *        OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT(INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/* Warm pool of connections to the converter.
+ *
+ * With CONVERT_POOL_SIZE=n, a background thread keeps up to n idle MPTCP
+ * connections to the converter open, each given time to join its extra
+ * subflows. connect() checks one out, moves it onto the app's fd and
+ * only has to send the CONNECT TLV: no handshake RTT and no subflow
+ * warm-up on the app's path. The thread refills the pool behind it.
+ */
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <linux/mptcp.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "convert_client.h"
+#include "convert_log.h"
+
+#define CONVERT_POOL_MAX 64
+/* how long a new connection may take to join its subflows */
+#define CONVERT_POOL_WARMUP_MS 500
+#define CONVERT_POOL_WARMUP_STEP_MS 10
+/* idle connections older than this may have been dropped by middleboxes */
+#define CONVERT_POOL_MAX_IDLE_S 60
+/* delay between attempts while the converter cannot be reached */
+#define CONVERT_POOL_BACKOFF_MAX_S 32
+
+struct pool_entry
+{
+	int fd;
+	int endpoint;
+	time_t since;
+};
+
+/* FIFO of warm connections, oldest first. */
+static struct
+{
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	struct pool_entry entries[CONVERT_POOL_MAX];
+	int head;
+	int count;
+	int size;
+	atomic_bool started;
+} _pool = {
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+	.cond = PTHREAD_COND_INITIALIZER,
+};
+
+static time_t
+_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec;
+}
+
+/* Give the path manager time to join the extra subflows: done once all
+ * the local endpoints it may use have one, or on fallback to TCP.
+ */
+static void
+_pool_warm_up(int fd)
+{
+	int waited;
+
+	for (waited = 0; waited < CONVERT_POOL_WARMUP_MS;
+		 waited += CONVERT_POOL_WARMUP_STEP_MS)
+	{
+		struct mptcp_info info;
+		socklen_t len = sizeof(info);
+		int target;
+
+		memset(&info, 0, sizeof(info));
+		if (getsockopt(fd, SOL_MPTCP, MPTCP_INFO, &info, &len) < 0 ||
+			info.mptcpi_flags & MPTCP_INFO_FLAG_FALLBACK)
+			return;
+
+		target = info.mptcpi_local_addr_max;
+		if (target > info.mptcpi_subflows_max)
+			target = info.mptcpi_subflows_max;
+		if (info.mptcpi_subflows >= target)
+			return;
+
+		usleep(CONVERT_POOL_WARMUP_STEP_MS * 1000);
+	}
+}
+
+/* Open a connection to the best converter endpoint. */
+static int
+_pool_open(int *endpoint)
+{
+	const struct sockaddr *addr;
+	socklen_t addrlen;
+	int fd;
+
+	*endpoint = convert_endpoint_pick(0);
+	if (*endpoint < 0)
+	{
+		errno = EHOSTUNREACH;
+		return -1;
+	}
+	addr = convert_endpoint_addr(*endpoint, &addrlen);
+
+	fd = SYS(socket)(addr->sa_family, SOCK_STREAM | SOCK_CLOEXEC,
+					 IPPROTO_MPTCP);
+	if (fd < 0)
+	{
+		int err = errno;
+
+		convert_endpoint_put(*endpoint);
+		errno = err;
+		return -1;
+	}
+
+	if (SYS(connect)(fd, addr, addrlen) < 0)
+	{
+		int err = errno;
+
+		convert_endpoint_failure(*endpoint);
+		convert_endpoint_put(*endpoint);
+		SYS(close)(fd);
+		errno = err;
+		return -1;
+	}
+
+	_pool_warm_up(fd);
+	return fd;
+}
+
+static void *
+_pool_refill(UNUSED void *arg)
+{
+	unsigned int backoff = 0;
+
+	for (;;)
+	{
+		int endpoint;
+		int fd;
+
+		pthread_mutex_lock(&_pool.lock);
+		while (_pool.count >= _pool.size)
+			pthread_cond_wait(&_pool.cond, &_pool.lock);
+		pthread_mutex_unlock(&_pool.lock);
+
+		fd = _pool_open(&endpoint);
+		if (fd < 0)
+		{
+			log_warn("unable to open a pooled connection: %s",
+				   strerror(errno));
+			backoff = backoff ? backoff * 2 : 1;
+			if (backoff > CONVERT_POOL_BACKOFF_MAX_S)
+				backoff = CONVERT_POOL_BACKOFF_MAX_S;
+			sleep(backoff);
+			continue;
+		}
+		backoff = 0;
+
+		pthread_mutex_lock(&_pool.lock);
+		if (_pool.count < _pool.size)
+		{
+			int tail = (_pool.head + _pool.count) % CONVERT_POOL_MAX;
+
+			_pool.entries[tail] = (struct pool_entry){fd, endpoint, _now()};
+			_pool.count++;
+			fd = -1;
+		}
+		pthread_mutex_unlock(&_pool.lock);
+
+		if (fd >= 0)
+		{
+			SYS(close)(fd);
+			convert_endpoint_put(endpoint);
+		}
+	}
+
+	return NULL;
+}
+
+static void
+_pool_start(void)
+{
+	pthread_t thread;
+	sigset_t all, old;
+
+	if (atomic_exchange(&_pool.started, true))
+		return;
+
+	/* leave the app's signals to the app's threads */
+	sigfillset(&all);
+	pthread_sigmask(SIG_SETMASK, &all, &old);
+
+	if (pthread_create(&thread, NULL, _pool_refill, NULL) == 0)
+		pthread_detach(thread);
+	else
+	{
+		log_error("unable to start the pool thread");
+		atomic_store(&_pool.started, false);
+	}
+
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+}
+
+/* The child shares the pooled connections with its parent: drop its
+ * copies and let its first connect start its own thread.
+ */
+static void
+_pool_atfork_child(void)
+{
+	pthread_mutex_init(&_pool.lock, NULL);
+	pthread_cond_init(&_pool.cond, NULL);
+
+	for (; _pool.count > 0; _pool.count--)
+	{
+		SYS(close)(_pool.entries[_pool.head].fd);
+		convert_endpoint_put(_pool.entries[_pool.head].endpoint);
+		_pool.head = (_pool.head + 1) % CONVERT_POOL_MAX;
+	}
+
+	atomic_store(&_pool.started, false);
+}
+
+int
+convert_pool_init(int size)
+{
+	if (size <= 0)
+		return 0;
+
+	if (size > CONVERT_POOL_MAX)
+		size = CONVERT_POOL_MAX;
+
+	_pool.size = size;
+
+	return pthread_atfork(NULL, NULL, _pool_atfork_child) == 0 ? 0 : -1;
+}
+
+/* The converter never speaks first: pending data or EOF on an idle
+ * connection means that it is gone.
+ */
+static bool
+_pool_entry_usable(const struct pool_entry *entry)
+{
+	char c;
+
+	if (_now() - entry->since > CONVERT_POOL_MAX_IDLE_S)
+		return false;
+
+	return SYS(recv)(entry->fd, &c, 1, MSG_PEEK | MSG_DONTWAIT) < 0 &&
+		   (errno == EAGAIN || errno == EWOULDBLOCK);
+}
+
+static int
+_pool_get(int *endpoint)
+{
+	struct pool_entry entry;
+
+	for (;;)
+	{
+		pthread_mutex_lock(&_pool.lock);
+		if (!_pool.count)
+		{
+			pthread_cond_signal(&_pool.cond);
+			pthread_mutex_unlock(&_pool.lock);
+			return -1;
+		}
+
+		entry = _pool.entries[_pool.head];
+		_pool.head = (_pool.head + 1) % CONVERT_POOL_MAX;
+		_pool.count--;
+		pthread_cond_signal(&_pool.cond);
+		pthread_mutex_unlock(&_pool.lock);
+
+		if (_pool_entry_usable(&entry))
+		{
+			*endpoint = entry.endpoint;
+			return entry.fd;
+		}
+
+		SYS(close)(entry.fd);
+		convert_endpoint_put(entry.endpoint);
+	}
+}
+
+int
+convert_pool_take(socket_state_t *state)
+{
+	int err = errno;
+	int endpoint;
+	int fd;
+
+	/* a pooled connection has its own source address and port */
+	if (!_pool.size || convert_socket_bound(state->fd))
+		return -1;
+
+	_pool_start();
+
+	fd = _pool_get(&endpoint);
+	if (fd < 0)
+		goto out;
+
+	if (convert_socket_move(state, fd) < 0)
+	{
+		SYS(close)(fd);
+		convert_endpoint_put(endpoint);
+		fd = -1;
+		goto out;
+	}
+
+	state->endpoint = endpoint;
+	log_debug("fd %d uses a pooled connection to %s", state->fd,
+		   convert_endpoint_name(endpoint));
+
+out:
+	errno = err;
+	return fd < 0 ? -1 : 0;
+}
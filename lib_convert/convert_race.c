@@ -0,0 +1,398 @@
+/**
+ * Copyright(c) 2019, Tessares S.A.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ * list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and / or other materials provided with the distribution.
+ *
+ * 3. Neither the name of the copyright holder nor the names of its
+ * contributors may be used to endorse or promote products derived from
+ * this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED.IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ *        SERVICES; LOSS OF USE, DATA, OR PROFITS;
+ *        OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT(INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/* Racing the converter path against a direct connection.
+ *
+ * With CONVERT_RACE=1, a blocking connect() to a destination not seen
+ * before starts through the converter and, if that did not complete
+ * within CONVERT_RACE_DELAY ms (or failed), also opens a direct MPTCP
+ * connection, in the spirit of RFC 8305. The first to complete wins, the
+ * other one is aborted. The winner is cached per destination so that the
+ * next connections skip the loser; destinations that answered the direct
+ * MPTCP connection natively are remembered for longer.
+ */
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <linux/mptcp.h>
+#include <netinet/in.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "convert_client.h"
+#include "convert_log.h"
+
+/* power of 2 */
+#define CONVERT_RACE_CACHE_SIZE 256
+#define CONVERT_RACE_TTL_S 600
+#define CONVERT_RACE_NATIVE_TTL_S 3600
+
+struct race_entry
+{
+	struct in6_addr addr;
+	in_port_t port;
+	uint8_t path;
+	bool native;
+	time_t expires;
+};
+
+/* Direct-mapped cache: a new destination evicts the one in its slot. */
+static struct
+{
+	bool enabled;
+	int delay_ms;
+	pthread_mutex_t lock;
+	struct race_entry cache[CONVERT_RACE_CACHE_SIZE];
+} _race = {
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+};
+
+static long
+_now_ms(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/* IPv4 destinations are keyed by their v4-mapped address. */
+static bool
+_race_key(const struct sockaddr *addr, struct in6_addr *key, in_port_t *port)
+{
+	switch (addr->sa_family)
+	{
+	case AF_INET:
+	{
+		const struct sockaddr_in *in = (const struct sockaddr_in *)addr;
+
+		*key = (struct in6_addr){
+			.s6_addr32 = {0, 0, htonl(0xffff), in->sin_addr.s_addr},
+		};
+		*port = in->sin_port;
+		return true;
+	}
+	case AF_INET6:
+	{
+		const struct sockaddr_in6 *in6 = (const struct sockaddr_in6 *)addr;
+
+		*key = in6->sin6_addr;
+		*port = in6->sin6_port;
+		return true;
+	}
+	default:
+		return false;
+	}
+}
+
+static struct race_entry *
+_race_slot(const struct in6_addr *key, in_port_t port)
+{
+	uint32_t hash = 2166136261u;
+	size_t i;
+
+	/* FNV-1a */
+	for (i = 0; i < sizeof(*key); i++)
+		hash = (hash ^ key->s6_addr[i]) * 16777619u;
+	hash = (hash ^ (port & 0xff)) * 16777619u;
+	hash = (hash ^ (port >> 8)) * 16777619u;
+
+	return &_race.cache[hash & (CONVERT_RACE_CACHE_SIZE - 1)];
+}
+
+void
+convert_race_init(int delay_ms)
+{
+	_race.delay_ms = delay_ms;
+	_race.enabled = true;
+}
+
+int
+convert_race_lookup(const struct sockaddr *addr)
+{
+	struct race_entry *entry;
+	struct in6_addr key;
+	in_port_t port;
+	int path = CONVERT_PATH_UNKNOWN;
+
+	if (!_race.enabled || !_race_key(addr, &key, &port))
+		return CONVERT_PATH_UNKNOWN;
+
+	pthread_mutex_lock(&_race.lock);
+	entry = _race_slot(&key, port);
+	if (entry->path && entry->port == port &&
+		IN6_ARE_ADDR_EQUAL(&entry->addr, &key) &&
+		entry->expires > time(NULL))
+		path = entry->path;
+	pthread_mutex_unlock(&_race.lock);
+
+	return path;
+}
+
+static void
+_race_record(const struct sockaddr *addr, int path, bool native)
+{
+	struct race_entry *entry;
+	struct in6_addr key;
+	in_port_t port;
+
+	if (!_race_key(addr, &key, &port))
+		return;
+
+	pthread_mutex_lock(&_race.lock);
+	entry = _race_slot(&key, port);
+	entry->addr = key;
+	entry->port = port;
+	entry->path = path;
+	entry->native = native;
+	entry->expires = time(NULL) +
+					 (native ? CONVERT_RACE_NATIVE_TTL_S : CONVERT_RACE_TTL_S);
+	pthread_mutex_unlock(&_race.lock);
+}
+
+void
+convert_race_forget(const struct sockaddr *addr)
+{
+	struct race_entry *entry;
+	struct in6_addr key;
+	in_port_t port;
+
+	if (!_race.enabled || !_race_key(addr, &key, &port))
+		return;
+
+	pthread_mutex_lock(&_race.lock);
+	entry = _race_slot(&key, port);
+	if (entry->port == port && IN6_ARE_ADDR_EQUAL(&entry->addr, &key))
+		entry->path = CONVERT_PATH_UNKNOWN;
+	pthread_mutex_unlock(&_race.lock);
+}
+
+/* Non-blocking connects are left to the app's event loop, and the direct
+ * connection could not honour a local address the app bound to.
+ */
+bool
+convert_race_wanted(socket_state_t *state)
+{
+	int fl;
+
+	if (!_race.enabled)
+		return false;
+
+	fl = fcntl(state->fd, F_GETFL);
+	return fl >= 0 && !(fl & O_NONBLOCK) && !convert_socket_bound(state->fd);
+}
+
+static int
+_race_open_direct(const struct sockaddr *addr, socklen_t addrlen)
+{
+	int fd;
+
+	fd = SYS(socket)(addr->sa_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC,
+					 IPPROTO_MPTCP);
+	if (fd < 0)
+		return -1;
+
+	if (SYS(connect)(fd, addr, addrlen) < 0 && errno != EINPROGRESS)
+	{
+		int err = errno;
+
+		SYS(close)(fd);
+		errno = err;
+		return -1;
+	}
+
+	return fd;
+}
+
+static bool
+_is_native_mptcp(int fd)
+{
+	struct mptcp_info info;
+	socklen_t len = sizeof(info);
+
+	memset(&info, 0, sizeof(info));
+	if (getsockopt(fd, SOL_MPTCP, MPTCP_INFO, &info, &len) < 0)
+		return false;
+
+	return !(info.mptcpi_flags & MPTCP_INFO_FLAG_FALLBACK);
+}
+
+/* Move the app's fd onto the direct connection, aborting the converter
+ * one it referred to.
+ */
+static int
+_race_adopt_direct(socket_state_t *state, int direct)
+{
+	struct linger linger = {1, 0};
+
+	setsockopt(state->fd, SOL_SOCKET, SO_LINGER, &linger, sizeof(linger));
+
+	return convert_socket_move(state, direct);
+}
+
+int
+convert_race_connect(socket_state_t *state, const struct sockaddr *addr,
+					 socklen_t addrlen)
+{
+	long start = _now_ms() + _race.delay_ms;
+	int fl = fcntl(state->fd, F_GETFL);
+	bool converter_out = false;
+	bool direct_out = false;
+	int winner = -1;
+	bool native = false;
+	int error = ECONNREFUSED;
+	int direct = -1;
+
+	log_debug("racing fd %d through the converter and directly", state->fd);
+
+	/* both legs are driven from here */
+	fcntl(state->fd, F_SETFL, fl | O_NONBLOCK);
+
+	if (convert_start(state) < 0)
+	{
+		error = errno;
+		converter_out = true;
+	}
+
+	while (winner < 0)
+	{
+		struct pollfd pfd[2];
+		int timeout = -1;
+		nfds_t n = 0;
+
+		if (!converter_out)
+		{
+			if (convert_handshake(state, CONVERT_HS_DONE, MSG_DONTWAIT) == 0)
+			{
+				winner = CONVERT_PATH_CONVERTER;
+				break;
+			}
+			if (errno != EAGAIN)
+			{
+				error = errno;
+				converter_out = true;
+			}
+		}
+
+		/* the direct leg starts after the delay, or as soon as the
+		 * converter one failed.
+		 */
+		if (direct < 0 && !direct_out)
+		{
+			long left = start - _now_ms();
+
+			if (converter_out || left <= 0)
+			{
+				direct = _race_open_direct(addr, addrlen);
+				if (direct < 0)
+				{
+					error = errno;
+					direct_out = true;
+				}
+			}
+			else
+				timeout = left;
+		}
+
+		if (converter_out && direct_out)
+			break;
+
+		if (!converter_out)
+			pfd[n++] = (struct pollfd){
+				.fd = state->fd,
+				.events = state->hs == CONVERT_HS_WAIT_REPLY ? POLLIN : POLLOUT,
+			};
+		if (direct >= 0)
+			pfd[n++] = (struct pollfd){.fd = direct, .events = POLLOUT};
+
+		if (SYS(poll)(pfd, n, timeout) < 0)
+		{
+			if (errno == EINTR)
+				continue;
+			error = errno;
+			break;
+		}
+
+		if (direct >= 0 && pfd[n - 1].revents)
+		{
+			socklen_t len = sizeof(int);
+			int err = 0;
+
+			if (getsockopt(direct, SOL_SOCKET, SO_ERROR, &err, &len) < 0)
+				err = errno;
+
+			if (!err)
+				winner = CONVERT_PATH_DIRECT;
+			else
+			{
+				error = err;
+				SYS(close)(direct);
+				direct = -1;
+				direct_out = true;
+			}
+		}
+	}
+
+	if (winner == CONVERT_PATH_DIRECT)
+	{
+		native = _is_native_mptcp(direct);
+		if (_race_adopt_direct(state, direct) < 0)
+		{
+			error = errno;
+			winner = -1;
+		}
+		else
+			/* now the app's fd */
+			direct = -1;
+	}
+
+	if (direct >= 0)
+		SYS(close)(direct);
+
+	fcntl(state->fd, F_SETFL, fl);
+
+	if (winner < 0)
+	{
+		errno = error;
+		return -1;
+	}
+
+	log_debug("fd %d connected %s%s", state->fd,
+		   winner == CONVERT_PATH_DIRECT ? "directly" : "through the converter",
+		   native ? " with native MPTCP" : "");
+
+	_race_record(addr, winner, native);
+	return winner;
+}
@@ -0,0 +1,325 @@
+/**
+ * Copyright(c) 2019, Tessares S.A.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ * list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and / or other materials provided with the distribution.
+ *
+ * 3. Neither the name of the copyright holder nor the names of its
+ * contributors may be used to endorse or promote products derived from
+ * this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED.IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ *        SERVICES; LOSS OF USE, DATA, OR PROFITS;
+ *        OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT(INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+/* convert_stat: aggregate the statistics segments of the processes
+ * running with lib_convert and CONVERT_STATS=1.
+ *
+ *   convert_stat [-a] [-p pid] [-u]
+ *
+ * -a also counts the segments left behind by processes that died without
+ * removing theirs, -p restricts the output to one process, and -u
+ * removes the segments of dead processes.
+ */
+
+#define _GNU_SOURCE
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "convert.h"
+#include "convert_stats.h"
+
+#define SHM_DIR "/dev/shm"
+
+static const char *_counter_names[CONVERT_STAT_MAX] = {
+	[CONVERT_STAT_SOCKETS] = "sockets intercepted",
+	[CONVERT_STAT_REDIRECTS] = "redirects",
+	[CONVERT_STAT_FALLBACKS] = "fallbacks",
+	[CONVERT_STAT_DIRECT] = "direct after race",
+	[CONVERT_STAT_POOLED] = "pooled",
+	[CONVERT_STAT_FAILOVERS] = "failovers",
+	[CONVERT_STAT_HS_FAILURES] = "handshake failures",
+};
+
+static const char *_hist_names[CONVERT_HIST_MAX] = {
+	[CONVERT_HIST_CONNECT] = "converter connect time",
+	[CONVERT_HIST_REPLY] = "convert reply latency",
+};
+
+/* plain copy of a segment, summed over the processes */
+struct totals
+{
+	uint64_t counters[CONVERT_STAT_MAX];
+	uint64_t errors[256];
+	uint64_t sum_us[CONVERT_HIST_MAX];
+	uint64_t buckets[CONVERT_HIST_MAX][CONVERT_STATS_BUCKETS];
+};
+
+static const char *
+_error_name(int code)
+{
+	switch (code)
+	{
+	case CONVERT_ERROR_UNSUPPORTED_VERSION:
+		return "unsupported version";
+	case CONVERT_ERROR_MALFORMED_MSG:
+		return "malformed message";
+	case CONVERT_ERROR_UNSUPPORTED_MSG:
+		return "unsupported message";
+	case CONVERT_ERROR_MISSING_COOKIE:
+		return "missing cookie";
+	case CONVERT_ERROR_UNAUTHORIZED:
+		return "not authorized";
+	case CONVERT_ERROR_UNSUPPORTED_TCP_OPT:
+		return "unsupported TCP option";
+	case CONVERT_ERROR_RESOURCE_EXCEEDED:
+		return "resource exceeded";
+	case CONVERT_ERROR_NETWORK_FAILURE:
+		return "network failure";
+	case CONVERT_ERROR_CONN_RESET:
+		return "connection reset";
+	case CONVERT_ERROR_DEST_UNREACH:
+		return "destination unreachable";
+	default:
+		return "unknown";
+	}
+}
+
+static bool
+_alive(pid_t pid)
+{
+	return kill(pid, 0) == 0 || errno == EPERM;
+}
+
+/* Add the segment to the totals. The counters keep moving while they are
+ * read: each one is consistent, the set of them is approximate.
+ */
+static void
+_add(struct totals *t, const struct convert_stats *s)
+{
+	int i, j;
+
+	for (i = 0; i < CONVERT_STAT_MAX; i++)
+		t->counters[i] += atomic_load_explicit(&s->counters[i],
+											   memory_order_relaxed);
+
+	for (i = 0; i < 256; i++)
+		t->errors[i] += atomic_load_explicit(&s->errors[i],
+											 memory_order_relaxed);
+
+	for (i = 0; i < CONVERT_HIST_MAX; i++)
+	{
+		t->sum_us[i] += atomic_load_explicit(&s->hists[i].sum_us,
+											 memory_order_relaxed);
+		for (j = 0; j < CONVERT_STATS_BUCKETS; j++)
+			t->buckets[i][j] += atomic_load_explicit(
+				&s->hists[i].buckets[j], memory_order_relaxed);
+	}
+}
+
+static void
+_print_bound(uint64_t us)
+{
+	if (us >= 1000000)
+		printf("%6" PRIu64 " s ", us / 1000000);
+	else if (us >= 1000)
+		printf("%6" PRIu64 " ms", us / 1000);
+	else
+		printf("%6" PRIu64 " us", us);
+}
+
+static void
+_print_hist(const char *name, uint64_t sum_us, const uint64_t *buckets)
+{
+	uint64_t count = 0;
+	uint64_t max = 0;
+	int first = -1;
+	int last = -1;
+	int i;
+
+	for (i = 0; i < CONVERT_STATS_BUCKETS; i++)
+	{
+		count += buckets[i];
+		if (buckets[i] > max)
+			max = buckets[i];
+		if (buckets[i])
+		{
+			if (first < 0)
+				first = i;
+			last = i;
+		}
+	}
+
+	printf("\n%s: %" PRIu64 " samples", name, count);
+	if (!count)
+	{
+		printf("\n");
+		return;
+	}
+	printf(", mean %" PRIu64 " us\n", sum_us / count);
+
+	for (i = first; i <= last; i++)
+	{
+		int bar = buckets[i] * 40 / max;
+
+		printf("  ");
+		_print_bound(i ? 1ull << (i - 1) : 0);
+		printf(" .. ");
+		if (i == CONVERT_STATS_BUCKETS - 1)
+			printf("     inf  ");
+		else
+			_print_bound(i ? 1ull << i : 1);
+		printf(" %10" PRIu64 " %.*s\n", buckets[i], bar,
+			   "########################################");
+	}
+}
+
+static void
+_print(const struct totals *t, int processes)
+{
+	int i;
+
+	printf("processes: %d\n", processes);
+	for (i = 0; i < CONVERT_STAT_MAX; i++)
+		printf("%-20s %" PRIu64 "\n", _counter_names[i], t->counters[i]);
+
+	for (i = 0; i < 256; i++)
+		if (t->errors[i])
+			printf("convert error %3d    %" PRIu64 " (%s)\n", i,
+				   t->errors[i], _error_name(i));
+
+	for (i = 0; i < CONVERT_HIST_MAX; i++)
+		_print_hist(_hist_names[i], t->sum_us[i], t->buckets[i]);
+}
+
+static void
+_usage(const char *prog)
+{
+	fprintf(stderr, "usage: %s [-a] [-p pid] [-u]\n", prog);
+	exit(2);
+}
+
+int
+main(int argc, char **argv)
+{
+	struct totals totals = {0};
+	bool dead_too = false;
+	bool unlink_dead = false;
+	pid_t only = 0;
+	int processes = 0;
+	struct dirent *entry;
+	DIR *dir;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "ap:u")) != -1)
+	{
+		switch (opt)
+		{
+		case 'a':
+			dead_too = true;
+			break;
+		case 'p':
+			only = atoi(optarg);
+			break;
+		case 'u':
+			unlink_dead = true;
+			break;
+		default:
+			_usage(argv[0]);
+		}
+	}
+
+	dir = opendir(SHM_DIR);
+	if (!dir)
+	{
+		fprintf(stderr, "unable to open %s: %s\n", SHM_DIR, strerror(errno));
+		return 1;
+	}
+
+	while ((entry = readdir(dir)))
+	{
+		const struct convert_stats *stats;
+		char name[sizeof(entry->d_name) + 1];
+		struct stat st;
+		pid_t pid;
+		int fd;
+
+		if (strncmp(entry->d_name, CONVERT_STATS_PREFIX,
+					strlen(CONVERT_STATS_PREFIX)) != 0)
+			continue;
+
+		pid = atoi(entry->d_name + strlen(CONVERT_STATS_PREFIX));
+		if (only && pid != only)
+			continue;
+
+		snprintf(name, sizeof(name), "/%s", entry->d_name);
+
+		if (!_alive(pid))
+		{
+			if (unlink_dead)
+				shm_unlink(name);
+			if (!dead_too || unlink_dead)
+				continue;
+		}
+
+		/* read-only: the processes are never held up */
+		fd = shm_open(name, O_RDONLY, 0);
+		if (fd < 0)
+			continue;
+
+		if (fstat(fd, &st) < 0 || (size_t)st.st_size < sizeof(*stats))
+		{
+			close(fd);
+			continue;
+		}
+
+		stats = mmap(NULL, sizeof(*stats), PROT_READ, MAP_SHARED, fd, 0);
+		close(fd);
+		if (stats == MAP_FAILED)
+			continue;
+
+		/* skip segments being created or from another version */
+		if (atomic_load_explicit(&stats->magic, memory_order_acquire) ==
+				CONVERT_STATS_MAGIC &&
+			stats->version == CONVERT_STATS_VERSION &&
+			stats->size == sizeof(*stats))
+		{
+			_add(&totals, stats);
+			processes++;
+		}
+
+		munmap((void *)stats, sizeof(*stats));
+	}
+	closedir(dir);
+
+	_print(&totals, processes);
+	return 0;
+}
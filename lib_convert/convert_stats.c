@@ -0,0 +1,120 @@
+/**
+ * Copyright(c) 2019, Tessares S.A.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ * list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and / or other materials provided with the distribution.
+ *
+ * 3. Neither the name of the copyright holder nor the names of its
+ * contributors may be used to endorse or promote products derived from
+ * this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED.IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ *        SERVICES; LOSS OF USE, DATA, OR PROFITS;
+ *        OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT(INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "convert_log.h"
+#include "convert_stats.h"
+
+struct convert_stats *convert_stats;
+
+/* shm_open() name of the segment owned by this process */
+static char _name[64];
+
+static struct convert_stats *
+_open_segment(void)
+{
+	struct convert_stats *stats;
+	int fd;
+
+	snprintf(_name, sizeof(_name), "/" CONVERT_STATS_PREFIX "%d", getpid());
+
+	/* an exec()'d image of this process starts over in the same segment */
+	fd = shm_open(_name, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+	if (fd < 0)
+		return NULL;
+
+	if (ftruncate(fd, sizeof(*stats)) < 0)
+	{
+		close(fd);
+		shm_unlink(_name);
+		return NULL;
+	}
+
+	stats = mmap(NULL, sizeof(*stats), PROT_READ | PROT_WRITE, MAP_SHARED,
+				 fd, 0);
+	close(fd);
+	if (stats == MAP_FAILED)
+	{
+		shm_unlink(_name);
+		return NULL;
+	}
+
+	stats->version = CONVERT_STATS_VERSION;
+	stats->size = sizeof(*stats);
+	stats->pid = getpid();
+	stats->start_time = time(NULL);
+	atomic_store_explicit(&stats->magic, CONVERT_STATS_MAGIC,
+						  memory_order_release);
+	return stats;
+}
+
+/* The child still maps the parent's segment: count in its own instead. */
+static void
+_atfork_child(void)
+{
+	struct convert_stats *parent = convert_stats;
+
+	convert_stats = _open_segment();
+	munmap(parent, sizeof(*parent));
+}
+
+int
+convert_stats_init(void)
+{
+	convert_stats = _open_segment();
+	if (!convert_stats)
+		return -1;
+
+	pthread_atfork(NULL, NULL, _atfork_child);
+
+	log_info("statistics in /dev/shm%s", _name);
+	return 0;
+}
+
+void
+convert_stats_fini(void)
+{
+	if (!convert_stats)
+		return;
+
+	/* threads may still count: the mapping goes away with the process */
+	shm_unlink(_name);
+}
@@ -0,0 +1,147 @@
+/**
+ * Copyright(c) 2019, Tessares S.A.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ * list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and / or other materials provided with the distribution.
+ *
+ * 3. Neither the name of the copyright holder nor the names of its
+ * contributors may be used to endorse or promote products derived from
+ * this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED.IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ *        SERVICES; LOSS OF USE, DATA, OR PROFITS;
+ *        OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT(INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+/* Per-process statistics of the interception library.
+ *
+ * With CONVERT_STATS=1 each preloaded process keeps its counters in the
+ * shared memory segment /dev/shm/convert-stats.<pid>, removed by exit()
+ * (convert_stat -u removes those left by processes that did not go
+ * through it). Updates are relaxed atomic increments: convert_stat maps
+ * the segments read-only and aggregates them while the processes run.
+ * The layout below is shared by both and versioned.
+ */
+
+#ifndef _CONVERT_STATS_H_
+#define _CONVERT_STATS_H_
+
+#include <stdatomic.h>
+#include <stdint.h>
+
+/* shm_open() name is CONVERT_STATS_PREFIX<pid> */
+#define CONVERT_STATS_PREFIX "convert-stats."
+#define CONVERT_STATS_MAGIC 0x43565354 /* CVST */
+#define CONVERT_STATS_VERSION 1
+
+/* bucket 0 counts 0 us, bucket i counts [2^(i-1), 2^i) us, the last one
+ * everything above.
+ */
+#define CONVERT_STATS_BUCKETS 32
+
+/* the counters are shared with other processes */
+_Static_assert(ATOMIC_LLONG_LOCK_FREE == 2, "64-bit atomics must be lock-free");
+
+enum
+{
+	CONVERT_STAT_SOCKETS = 0,	/* MPTCP sockets intercepted */
+	CONVERT_STAT_REDIRECTS,		/* connects sent to the converter */
+	CONVERT_STAT_FALLBACKS,		/* connects that could not use the converter */
+	CONVERT_STAT_DIRECT,		/* connects that went direct after a race */
+	CONVERT_STAT_POOLED,		/* redirects served by a pooled connection */
+	CONVERT_STAT_FAILOVERS,		/* moves to another converter endpoint */
+	CONVERT_STAT_HS_FAILURES,	/* handshakes that failed */
+	CONVERT_STAT_MAX,
+};
+
+enum
+{
+	CONVERT_HIST_CONNECT = 0,	/* connection to the converter */
+	CONVERT_HIST_REPLY,			/* CONNECT TLV sent to reply received */
+	CONVERT_HIST_MAX,
+};
+
+struct convert_stats_hist
+{
+	_Atomic uint64_t sum_us;
+	_Atomic uint64_t buckets[CONVERT_STATS_BUCKETS];
+};
+
+struct convert_stats
+{
+	/* magic is written last, once the rest is set */
+	_Atomic uint32_t magic;
+	uint32_t version;
+	uint32_t size;
+	int32_t pid;
+	int64_t start_time;
+
+	_Atomic uint64_t counters[CONVERT_STAT_MAX];
+	/* Convert error TLVs received, by error code */
+	_Atomic uint64_t errors[256];
+	struct convert_stats_hist hists[CONVERT_HIST_MAX];
+};
+
+/* NULL unless CONVERT_STATS=1 */
+extern struct convert_stats *convert_stats;
+
+/* Create the segment of this process. Returns -1 on failure. */
+int convert_stats_init(void);
+void convert_stats_fini(void);
+
+static inline void
+convert_stat_inc(int counter)
+{
+	if (convert_stats)
+		atomic_fetch_add_explicit(&convert_stats->counters[counter], 1,
+								  memory_order_relaxed);
+}
+
+static inline void
+convert_stat_error(uint8_t code)
+{
+	if (convert_stats)
+		atomic_fetch_add_explicit(&convert_stats->errors[code], 1,
+								  memory_order_relaxed);
+}
+
+static inline int
+convert_stats_bucket(uint64_t us)
+{
+	int bucket = us ? 64 - __builtin_clzll(us) : 0;
+
+	return bucket < CONVERT_STATS_BUCKETS ? bucket : CONVERT_STATS_BUCKETS - 1;
+}
+
+static inline void
+convert_stat_time(int hist, long us)
+{
+	struct convert_stats_hist *h;
+
+	if (!convert_stats || us < 0)
+		return;
+
+	h = &convert_stats->hists[hist];
+	atomic_fetch_add_explicit(&h->sum_us, us, memory_order_relaxed);
+	atomic_fetch_add_explicit(&h->buckets[convert_stats_bucket(us)], 1,
+							  memory_order_relaxed);
+}
+
+#endif
@@ -33,6 +33,7 @@
 #include <stdlib.h>
 
 #include "convert_util.h"
+#include "convert_log.h"
 
 #define CONVERT_TO_BYTES(v) (v * CONVERT_PADDING)
 #define BYTES_TO_CONVERT(v) (v / CONVERT_PADDING)
@@ -41,22 +42,29 @@ int convert_parse_header(const uint8_t *buff, size_t buff_len, size_t *tlvs_leng
 {
 	struct convert_header *hdr = (struct convert_header *)buff;
 
-	if (buff_len != sizeof(*hdr))
+	if (buff_len < sizeof(*hdr))
 	{
-		printf("buff_len != sizeof(*hdr)\n");
+		log_debug("buff_len < sizeof(*hdr)");
 		return -1;
 	}
 
 	/* only support a single version */
 	if (hdr->version != CONVERT_VERSION)
 	{
-		printf("hdr->version = %d != CONVERT_VERSION\n", hdr->version);
+		log_debug("hdr->version = %d != CONVERT_VERSION", hdr->version);
 		return -1;
 	}
 
 	if (ntohs(hdr->magic_no) != CONVERT_MAGIC_NO)
 	{
-		printf("ntohs(hdr->magic_no) = %d != CONVERT_MAGIC_NO\n", ntohs(hdr->magic_no));
+		log_debug("ntohs(hdr->magic_no) = %d != CONVERT_MAGIC_NO", ntohs(hdr->magic_no));
+		return -1;
+	}
+
+	if (CONVERT_TO_BYTES(hdr->total_length) < sizeof(*hdr))
+	{
+		log_debug("hdr->total_length = %d is shorter than the header",
+				  hdr->total_length);
 		return -1;
 	}
 
@@ -68,136 +76,320 @@ void convert_free_opts(struct convert_opts *opts)
 {
 	free(opts->tcp_options);
 	free(opts->cookie_data);
+	free(opts->supported_tcp_ext);
+	free(opts->connect_options);
+	free(opts->error_value);
 	free(opts);
 }
 
-struct convert_opts *
-convert_parse_tlvs(const uint8_t *buff, size_t buff_len)
+int
+convert_parse_tlvs_view(const uint8_t *buff, size_t buff_len,
+						struct convert_opts_view *view)
 {
-	struct convert_opts *opts;
+	memset(view, 0, sizeof(*view));
 
 	if (buff_len == 0)
-		return NULL;
-
-	opts = calloc(sizeof(struct convert_opts), 1);
-	if (!opts)
-		return NULL;
+		return -1;
 
 	while (buff_len > 0)
 	{
-		struct convert_tlv *tlv = (struct convert_tlv *)buff;
+		const struct convert_tlv *tlv = (const struct convert_tlv *)buff;
 		size_t tlv_len;
 
 		if (buff_len < CONVERT_ALIGN(sizeof(*tlv)))
-			goto error_and_free;
+			return -1;
 
 		tlv_len = CONVERT_TO_BYTES(tlv->length);
 
-		if (buff_len < tlv_len)
-			goto error_and_free;
+		/* an empty TLV would never end the walk */
+		if (buff_len < tlv_len || tlv_len < CONVERT_ALIGN(sizeof(*tlv)))
+			return -1;
 
 		switch (tlv->type)
 		{
 		case CONVERT_ERROR:
 		{
-			struct convert_error *error =
-				(struct convert_error *)buff;
+			const struct convert_error *error =
+				(const struct convert_error *)buff;
+			size_t value_len;
+
+			if (tlv_len < CONVERT_ALIGN(sizeof(*error)))
+				return -1;
 
-			if (buff_len < CONVERT_ALIGN(sizeof(*error)))
-				goto error_and_free;
+			/* the padding is made of zero bytes */
+			value_len = tlv_len - sizeof(*error);
+			while (value_len && !error->value[value_len - 1])
+				value_len--;
 
-			opts->flags |= CONVERT_F_ERROR;
-			opts->error_code = error->error_code;
-			/* TODO support handling the field: value */
+			view->flags |= CONVERT_F_ERROR;
+			view->error_code = error->error_code;
+			view->error_value = error->value;
+			view->error_value_len = value_len;
 
 			break;
 		}
 		case CONVERT_CONNECT:
 		{
-			struct convert_connect *conv_connect =
-				(struct convert_connect *)buff;
+			const struct convert_connect *conv_connect =
+				(const struct convert_connect *)buff;
 
-			if (buff_len < CONVERT_ALIGN(sizeof(*conv_connect)))
-				goto error_and_free;
+			if (tlv_len < CONVERT_ALIGN(sizeof(*conv_connect)))
+				return -1;
 
-			/* TODO support the options. */
-			if (CONVERT_TO_BYTES(tlv->length) !=
-				CONVERT_ALIGN(sizeof(*conv_connect)))
-				goto error_and_free;
-
-			opts->flags |= CONVERT_F_CONNECT;
+			view->flags |= CONVERT_F_CONNECT;
 			/* conv_connect comes from the network, and thus is in
 			 * network byte order. The sin6_port and sin6_addr
 			 * members of remote_addr shall also be in network byte
 			 * order.
 			 */
-			opts->remote_addr.sin6_addr =
-				conv_connect->remote_addr;
-			opts->remote_addr.sin6_port =
-				conv_connect->remote_port;
+			view->remote_addr.sin6_addr = conv_connect->remote_addr;
+			view->remote_addr.sin6_port = conv_connect->remote_port;
+			view->connect_options = conv_connect->options;
+			view->connect_options_len = tlv_len - sizeof(*conv_connect);
 
 			break;
 		}
 		case CONVERT_EXTENDED_TCP_HDR:
 		{
-			struct convert_extended_tcp_hdr *conv_ext_tcp_hdr =
-				(struct convert_extended_tcp_hdr *)buff;
-			size_t tcp_options_len =
-				tlv_len -
-				sizeof(struct convert_extended_tcp_hdr);
-
-			if (buff_len < CONVERT_ALIGN(sizeof(*conv_ext_tcp_hdr)))
-				goto error_and_free;
+			const struct convert_extended_tcp_hdr *conv_ext_tcp_hdr =
+				(const struct convert_extended_tcp_hdr *)buff;
 
-			opts->flags |= CONVERT_F_EXTENDED_TCP_HDR;
+			if (tlv_len < CONVERT_ALIGN(sizeof(*conv_ext_tcp_hdr)))
+				return -1;
 
-			opts->tcp_options_len = tcp_options_len;
-			opts->tcp_options = malloc(tcp_options_len);
-			if (opts->tcp_options == NULL)
-				goto error_and_free;
-			memcpy(opts->tcp_options, conv_ext_tcp_hdr->tcp_options,
-				   tcp_options_len);
+			view->flags |= CONVERT_F_EXTENDED_TCP_HDR;
+			view->tcp_options = conv_ext_tcp_hdr->tcp_options;
+			view->tcp_options_len =
+				tlv_len - sizeof(struct convert_extended_tcp_hdr);
 
 			break;
 		}
 		case CONVERT_COOKIE:
 		{
-			struct convert_cookie *cookie =
-				(struct convert_cookie *)buff;
-			size_t cookie_len =
-				tlv_len - sizeof(struct convert_cookie);
+			const struct convert_cookie *cookie =
+				(const struct convert_cookie *)buff;
 
-			opts->flags |= CONVERT_F_COOKIE;
+			view->flags |= CONVERT_F_COOKIE;
+			view->cookie_data = cookie->opaque;
+			view->cookie_len = tlv_len - sizeof(struct convert_cookie);
 
-			opts->cookie_len = cookie_len;
-			opts->cookie_data = malloc(cookie_len);
-			if (opts->cookie_data == NULL)
-				goto error_and_free;
-			memcpy(opts->cookie_data, cookie->opaque, cookie_len);
+			break;
+		}
+		case CONVERT_SUPPORTED_TCP_EXT:
+		{
+			const struct convert_supported_opts *supp_opts =
+				(const struct convert_supported_opts *)buff;
+			size_t kinds_len = tlv_len - sizeof(*supp_opts);
+
+			/* the padding is made of zero kinds (EOL) */
+			while (kinds_len && !supp_opts->options_kind[kinds_len - 1])
+				kinds_len--;
+
+			view->flags |= CONVERT_F_SUPPORTED_TCP_EXT;
+			view->supported_tcp_ext = supp_opts->options_kind;
+			view->supported_tcp_ext_len = kinds_len;
+
+			break;
+		}
+		case CONVERT_INFO:
+		{
+			if (tlv_len < CONVERT_ALIGN(sizeof(struct convert_info)))
+				return -1;
+
+			view->flags |= CONVERT_F_INFO;
 
 			break;
 		}
-		/* TODO support other TLVs. */
 		default:
-			goto error_and_free;
+			return -1;
 		}
 
 		buff += tlv_len;
 		buff_len -= tlv_len;
 	}
 
+	return 0;
+}
+
+static uint8_t *
+_dup_view(const uint8_t *data, size_t len)
+{
+	uint8_t *copy = malloc(len ?: 1);
+
+	if (copy)
+		memcpy(copy, data, len);
+	return copy;
+}
+
+struct convert_opts *
+convert_opts_from_view(const struct convert_opts_view *view)
+{
+	struct convert_opts *opts;
+
+	opts = calloc(sizeof(struct convert_opts), 1);
+	if (!opts)
+		return NULL;
+
+	opts->flags = view->flags;
+	opts->remote_addr = view->remote_addr;
+	opts->error_code = view->error_code;
+
+	if (view->flags & CONVERT_F_EXTENDED_TCP_HDR)
+	{
+		opts->tcp_options_len = view->tcp_options_len;
+		opts->tcp_options = _dup_view(view->tcp_options,
+									  view->tcp_options_len);
+		if (opts->tcp_options == NULL)
+			goto error_and_free;
+	}
+
+	if (view->flags & CONVERT_F_COOKIE)
+	{
+		opts->cookie_len = view->cookie_len;
+		opts->cookie_data = _dup_view(view->cookie_data, view->cookie_len);
+		if (opts->cookie_data == NULL)
+			goto error_and_free;
+	}
+
+	if (view->flags & CONVERT_F_SUPPORTED_TCP_EXT)
+	{
+		opts->supported_tcp_ext_len = view->supported_tcp_ext_len;
+		opts->supported_tcp_ext = _dup_view(view->supported_tcp_ext,
+											view->supported_tcp_ext_len);
+		if (opts->supported_tcp_ext == NULL)
+			goto error_and_free;
+	}
+
+	if ((view->flags & CONVERT_F_CONNECT) && view->connect_options_len)
+	{
+		opts->connect_options_len = view->connect_options_len;
+		opts->connect_options = _dup_view(view->connect_options,
+										  view->connect_options_len);
+		if (opts->connect_options == NULL)
+			goto error_and_free;
+	}
+
+	if ((view->flags & CONVERT_F_ERROR) && view->error_value_len)
+	{
+		opts->error_value_len = view->error_value_len;
+		opts->error_value = _dup_view(view->error_value,
+									  view->error_value_len);
+		if (opts->error_value == NULL)
+			goto error_and_free;
+	}
+
 	return opts;
 
 error_and_free:
-	free(opts);
+	convert_free_opts(opts);
 	return NULL;
 }
 
+struct convert_opts *
+convert_parse_tlvs(const uint8_t *buff, size_t buff_len)
+{
+	struct convert_opts_view view;
+
+	if (convert_parse_tlvs_view(buff, buff_len, &view) < 0)
+		return NULL;
+
+	return convert_opts_from_view(&view);
+}
+
+void
+convert_parser_init(struct convert_parser *parser)
+{
+	parser->state = CONVERT_PARSER_HDR;
+	parser->len = 0;
+	parser->need = CONVERT_HDR_LEN;
+}
+
+size_t
+convert_parser_want(const struct convert_parser *parser)
+{
+	if (parser->state == CONVERT_PARSER_HDR ||
+		parser->state == CONVERT_PARSER_TLVS)
+		return parser->need - parser->len;
+	return 0;
+}
+
+int
+convert_parser_feed(struct convert_parser *parser, const uint8_t *data,
+					size_t len, size_t *consumed)
+{
+	size_t used = 0;
+
+	while (parser->state == CONVERT_PARSER_HDR ||
+		   parser->state == CONVERT_PARSER_TLVS)
+	{
+		size_t chunk = parser->need - parser->len;
+		size_t length;
+
+		if (chunk > len - used)
+			chunk = len - used;
+
+		memcpy(parser->buff + parser->len, data + used, chunk);
+		parser->len += chunk;
+		used += chunk;
+
+		if (parser->len < parser->need)
+			break;
+
+		if (parser->state == CONVERT_PARSER_TLVS)
+		{
+			if (convert_parse_tlvs_view(parser->buff + CONVERT_HDR_LEN,
+										parser->len - CONVERT_HDR_LEN,
+										&parser->opts) < 0)
+				parser->state = CONVERT_PARSER_ERROR;
+			else
+				parser->state = CONVERT_PARSER_DONE;
+			break;
+		}
+
+		if (convert_parse_header(parser->buff, parser->len, &length) < 0)
+		{
+			parser->state = CONVERT_PARSER_ERROR;
+			break;
+		}
+
+		parser->need += length;
+		if (length)
+		{
+			parser->state = CONVERT_PARSER_TLVS;
+			continue;
+		}
+
+		memset(&parser->opts, 0, sizeof(parser->opts));
+		parser->state = CONVERT_PARSER_DONE;
+	}
+
+	if (consumed)
+		*consumed = used;
+
+	switch (parser->state)
+	{
+	case CONVERT_PARSER_DONE:
+		return CONVERT_PARSE_DONE;
+	case CONVERT_PARSER_ERROR:
+		return CONVERT_PARSE_ERROR;
+	default:
+		return CONVERT_PARSE_MORE;
+	}
+}
+
 static ssize_t
-_convert_write_tlv_not_supp(UNUSED uint8_t *buff, size_t UNUSED buff_len,
-							UNUSED const struct convert_opts *opts)
+_convert_write_tlv_info(uint8_t *buff, size_t buff_len,
+						UNUSED const struct convert_opts *opts)
 {
-	return -1;
+	struct convert_info *info = (struct convert_info *)buff;
+	size_t length = CONVERT_ALIGN(sizeof(*info));
+
+	if (buff_len < length)
+		return -1;
+
+	memset(info, '\0', length);
+
+	return length;
 }
 
 static ssize_t
@@ -206,13 +398,35 @@ _convert_write_tlv_connect(uint8_t *buff, size_t buff_len,
 {
 	struct convert_connect *conv_connect = (struct convert_connect *)buff;
 	size_t length =
-		CONVERT_ALIGN(sizeof(*conv_connect));
+		CONVERT_ALIGN(sizeof(*conv_connect) + opts->connect_options_len);
 
 	if (buff_len < length)
 		return -1;
 
+	memset(conv_connect, '\0', length);
 	conv_connect->remote_addr = opts->remote_addr.sin6_addr;
 	conv_connect->remote_port = opts->remote_addr.sin6_port;
+	memcpy(conv_connect->options, opts->connect_options,
+		   opts->connect_options_len);
+
+	return length;
+}
+
+static ssize_t
+_convert_write_tlv_supported_tcp_ext(uint8_t *buff, size_t buff_len,
+									 const struct convert_opts *opts)
+{
+	struct convert_supported_opts *supp_opts =
+		(struct convert_supported_opts *)buff;
+	size_t length = CONVERT_ALIGN(sizeof(*supp_opts) +
+								  opts->supported_tcp_ext_len);
+
+	if (buff_len < length)
+		return -1;
+
+	memset(supp_opts, '\0', length);
+	memcpy(supp_opts->options_kind, opts->supported_tcp_ext,
+		   opts->supported_tcp_ext_len);
 
 	return length;
 }
@@ -222,12 +436,14 @@ _convert_write_tlv_error(uint8_t *buff, size_t buff_len,
 						 const struct convert_opts *opts)
 {
 	struct convert_error *error = (struct convert_error *)buff;
-	size_t length = CONVERT_ALIGN(sizeof(*error));
+	size_t length = CONVERT_ALIGN(sizeof(*error) + opts->error_value_len);
 
 	if (buff_len < length)
 		return -1;
 
+	memset(error, '\0', length);
 	error->error_code = opts->error_code;
+	memcpy(error->value, opts->error_value, opts->error_value_len);
 
 	return length;
 }
@@ -278,7 +494,7 @@ static struct
 	[_CONVERT_F_INFO] = {
 		.flag = CONVERT_F_INFO,
 		.type = CONVERT_INFO,
-		.cb = _convert_write_tlv_not_supp,
+		.cb = _convert_write_tlv_info,
 	},
 	[_CONVERT_F_CONNECT] = {
 		.flag = CONVERT_F_CONNECT,
@@ -293,7 +509,7 @@ static struct
 	[_CONVERT_F_SUPPORTED_TCP_EXT] = {
 		.flag = CONVERT_F_SUPPORTED_TCP_EXT,
 		.type = CONVERT_SUPPORTED_TCP_EXT,
-		.cb = _convert_write_tlv_not_supp,
+		.cb = _convert_write_tlv_supported_tcp_ext,
 	},
 	[_CONVERT_F_COOKIE] = {
 		.flag = CONVERT_F_COOKIE,
@@ -366,66 +582,154 @@ convert_write(uint8_t *buff, size_t buff_len, const struct convert_opts *opts)
 	return length;
 }
 
-struct convert_opts *read_convert_opts(int fd, bool peek, int *error_code, char *error_message)
+int
+convert_template_init(struct convert_template *tmpl,
+					  const struct convert_opts *opts)
 {
-	uint8_t hdr[CONVERT_HDR_LEN];
-	int ret;
-	int flag = peek ? MSG_PEEK : 0;
-	size_t length;
-	size_t offset = peek ? CONVERT_HDR_LEN : 0;
-	struct convert_opts *opts;
+	struct convert_opts connect = *opts;
+	size_t off = CONVERT_HDR_LEN;
+	ssize_t len;
 
-	ret = recvfrom(fd, hdr, CONVERT_HDR_LEN, MSG_WAITALL | flag, NULL, NULL);
+	connect.flags |= CONVERT_F_CONNECT;
+	memset(&connect.remote_addr, 0, sizeof(connect.remote_addr));
 
-	if (ret < 0)
+	len = convert_write(tmpl->buff, sizeof(tmpl->buff), &connect);
+	if (len < 0)
+		return -1;
+
+	/* the TLVs are well-formed: we just wrote them */
+	while (off < (size_t)len)
 	{
-		*error_code = errno;
-		sprintf(error_message, "unable to read the convert header");
-		return NULL;
+		struct convert_tlv *tlv = (struct convert_tlv *)(tmpl->buff + off);
+
+		if (tlv->type == CONVERT_CONNECT)
+			break;
+		off += CONVERT_TO_BYTES(tlv->length);
 	}
 
-	if (convert_parse_header(hdr, ret, &length) < 0)
+	tmpl->len = len;
+	tmpl->connect_off = off;
+	return 0;
+}
+
+ssize_t
+convert_template_write(const struct convert_template *tmpl, uint8_t *buff,
+					   size_t buff_len, const struct sockaddr *addr)
+{
+	struct convert_connect *conv_connect;
+
+	if (buff_len < tmpl->len)
 	{
-		*error_code = errno;
-		sprintf(error_message, "unable to parse the convert header");
-		return NULL;
+		errno = EMSGSIZE;
+		return -1;
 	}
 
-	if (length)
+	memcpy(buff, tmpl->buff, tmpl->len);
+	conv_connect = (struct convert_connect *)(buff + tmpl->connect_off);
+
+	/* addresses and ports are already in network bytes */
+	switch (addr->sa_family)
+	{
+	case AF_INET:
 	{
-		uint8_t buffer[length + offset];
+		const struct sockaddr_in *in = (const struct sockaddr_in *)addr;
 
-		/* if peek the data was not yet read, so we need to
-		 * also read (again the main header). */
-		if (peek)
-			length += CONVERT_HDR_LEN;
+		conv_connect->remote_addr = (struct in6_addr){
+			.s6_addr32 = {0, 0, htonl(0xffff), in->sin_addr.s_addr},
+		};
+		conv_connect->remote_port = in->sin_port;
+		break;
+	}
+	case AF_INET6:
+	{
+		const struct sockaddr_in6 *in6 = (const struct sockaddr_in6 *)addr;
 
-		ret = recvfrom(fd, buffer, length, MSG_WAITALL, NULL, NULL);
-		if (ret != (int)length || ret < 0)
-		{
-			*error_code = errno;
-			sprintf(error_message, "unable to read the convert tlv data");
-			return NULL;
-		}
+		conv_connect->remote_addr = in6->sin6_addr;
+		conv_connect->remote_port = in6->sin6_port;
+		break;
+	}
+	default:
+		errno = EAFNOSUPPORT;
+		return -1;
+	}
 
-		opts = convert_parse_tlvs(buffer + offset, length - offset);
-		if (opts == NULL)
+	return tmpl->len;
+}
+
+int convert_error_to_errno(uint8_t error_code)
+{
+	switch (error_code)
+	{
+	case CONVERT_ERROR_UNAUTHORIZED:
+		return EACCES;
+	case CONVERT_ERROR_RESOURCE_EXCEEDED:
+		return ENOBUFS;
+	case CONVERT_ERROR_NETWORK_FAILURE:
+		return ENETUNREACH;
+	case CONVERT_ERROR_CONN_RESET:
+		return ECONNRESET;
+	case CONVERT_ERROR_DEST_UNREACH:
+		return EHOSTUNREACH;
+	default:
+		/* version, message and cookie errors: the converter refused
+		 * to relay the connection.
+		 */
+		return ECONNREFUSED;
+	}
+}
+
+struct convert_opts *read_convert_opts(int fd, int *error_code, char *error_message)
+{
+	uint8_t buffer[CONVERT_MSG_MAX_LEN];
+	struct convert_parser parser;
+	struct convert_opts *opts;
+	size_t want;
+	ssize_t ret;
+
+	/* Read no more than the parser wants: application data may already
+	 * follow the message and must stay in the socket.
+	 */
+	convert_parser_init(&parser);
+	while ((want = convert_parser_want(&parser)) > 0)
+	{
+		bool hdr = parser.state == CONVERT_PARSER_HDR;
+
+		ret = recvfrom(fd, buffer, want, MSG_WAITALL, NULL, NULL);
+		if (ret != (ssize_t)want)
 		{
-			// if opts is NULL it may be because of en empty buffer
-			// TODO: check if this is the case
+			*error_code = ret < 0 ? errno : ECONNRESET;
+			sprintf(error_message, hdr ? "unable to read the convert header"
+									   : "unable to read the convert tlv data");
 			return NULL;
 		}
 
-		/* if we receive the TLV error we need to inform the app */
-		if (opts->flags & CONVERT_F_ERROR)
+		if (convert_parser_feed(&parser, buffer, want, NULL) ==
+			CONVERT_PARSE_ERROR)
 		{
-			*error_code = (int)opts->error_code;
-			sprintf(error_message, "received error from the convert server: %d", opts->error_code);
-			convert_free_opts(opts);
+			*error_code = EBADMSG;
+			sprintf(error_message, hdr ? "unable to parse the convert header"
+									   : "unable to parse the convert tlvs");
 			return NULL;
 		}
 	}
+
+	/* if we receive the TLV error we need to inform the app */
+	if (parser.opts.flags & CONVERT_F_ERROR)
+	{
+		*error_code = (int)parser.opts.error_code;
+		sprintf(error_message, "received error from the convert server: %d",
+				parser.opts.error_code);
+		return NULL;
+	}
+
+	opts = convert_opts_from_view(&parser.opts);
+	if (opts == NULL)
+	{
+		*error_code = ENOMEM;
+		sprintf(error_message, "unable to allocate the convert options");
+		return NULL;
+	}
 	*error_code = 0;
 
 	return opts;
-}
\ No newline at end of file
+}
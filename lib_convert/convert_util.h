@@ -50,6 +50,8 @@
 #define __CONVERT_ALIGN(x, a) (((x) + (a - 1)) & ~(a - 1))
 #define CONVERT_ALIGN(bytes) __CONVERT_ALIGN(bytes, CONVERT_PADDING)
 #define CONVERT_HDR_LEN sizeof(struct convert_header)
+/* Largest Convert message: total_length counts 32-bit words in a byte. */
+#define CONVERT_MSG_MAX_LEN (UINT8_MAX * CONVERT_PADDING)
 
 enum
 {
@@ -80,9 +82,14 @@ struct convert_opts
 	 * The sin_port and sin_addr members shall be in network byte order.
 	 */
 	struct sockaddr_in6 remote_addr;
+	/* TCP options for the connection to the destination */
+	uint8_t *connect_options;
+	size_t connect_options_len;
 
-	/* if CONVERT_F_ERROR is set in flags */
+	/* if CONVERT_F_ERROR is set in flags; the value is padded */
 	uint8_t error_code;
+	uint8_t *error_value;
+	size_t error_value_len;
 
 	/* if CONVERT_F_EXTENDED_TCP_HDR is set in flags */
 	uint8_t *tcp_options;
@@ -92,13 +99,103 @@ struct convert_opts
 	uint8_t *cookie_data;
 	size_t cookie_len;
 
-	/* TODO extend to support more TLVs. */
+	/* if CONVERT_F_SUPPORTED_TCP_EXT is set in flags: the kinds of the
+	 * TCP options the converter supports
+	 */
+	uint8_t *supported_tcp_ext;
+	size_t supported_tcp_ext_len;
+};
+
+/* The TLVs of a Convert message as parsed in place: the variable-length
+ * fields point into the parsed buffer and are only valid with it.
+ */
+struct convert_opts_view
+{
+	uint8_t flags;
+	struct sockaddr_in6 remote_addr;
+	const uint8_t *connect_options;
+	size_t connect_options_len;
+
+	uint8_t error_code;
+	const uint8_t *error_value;
+	size_t error_value_len;
+
+	const uint8_t *tcp_options;
+	size_t tcp_options_len;
+
+	const uint8_t *cookie_data;
+	size_t cookie_len;
+
+	const uint8_t *supported_tcp_ext;
+	size_t supported_tcp_ext_len;
+};
+
+/* Results of convert_parser_feed(). */
+enum
+{
+	CONVERT_PARSE_ERROR = -1,
+	CONVERT_PARSE_MORE = 0,
+	CONVERT_PARSE_DONE = 1,
+};
+
+enum
+{
+	CONVERT_PARSER_HDR = 0,
+	CONVERT_PARSER_TLVS,
+	CONVERT_PARSER_DONE,
+	CONVERT_PARSER_ERROR,
+};
+
+/* Resumable parser of one Convert message arriving in chunks of any
+ * size. The message is gathered in buff, and opts points into it once
+ * the parse is done.
+ */
+struct convert_parser
+{
+	int state;
+	/* bytes gathered, out of the need known so far */
+	size_t len;
+	size_t need;
+	struct convert_opts_view opts;
+	uint8_t buff[CONVERT_MSG_MAX_LEN];
 };
 
 void convert_free_opts(struct convert_opts *opts);
 
+/* Copies the views into a struct convert_opts, to be freed with
+ * convert_free_opts(). Returns NULL upon failure.
+ */
+struct convert_opts *
+convert_opts_from_view(const struct convert_opts_view *view);
+
+void convert_parser_init(struct convert_parser *parser);
+
+/* Feed the next len bytes of the stream to the parser. Returns
+ * CONVERT_PARSE_MORE until the message is complete, then
+ * CONVERT_PARSE_DONE, or CONVERT_PARSE_ERROR if it is invalid. *consumed
+ * is set to the bytes of data that belong to the message: what follows is
+ * app data. A parser that is done or failed consumes nothing more.
+ */
+int convert_parser_feed(struct convert_parser *parser, const uint8_t *data,
+						size_t len, size_t *consumed);
+
+/* Bytes the parser is missing to make progress; reading no more than
+ * that never takes app data from the stream.
+ */
+size_t convert_parser_want(const struct convert_parser *parser);
+
+/* Parse the header of the message at buff, which holds at least its
+ * first CONVERT_HDR_LEN bytes. *tlvs_length is set to the length of the
+ * TLVs that follow. Returns -1 upon failure.
+ */
 int convert_parse_header(const uint8_t *buff, size_t buff_len, size_t *tlvs_length);
 
+/* Parse the TLVs into view, without allocating. Returns -1 upon
+ * failure.
+ */
+int convert_parse_tlvs_view(const uint8_t *buff, size_t buff_len,
+							struct convert_opts_view *view);
+
 /* Returns a pointer to struct convert_opts, which must be freed by the caller
  * using convert_free_opts(). Returns NULL upon failure.
  */
@@ -108,6 +205,38 @@ convert_parse_tlvs(const uint8_t *buff, size_t buff_len);
 ssize_t
 convert_write(uint8_t *buff, size_t buff_len, const struct convert_opts *opts);
 
-struct convert_opts *read_convert_opts(int fd, bool peek, int* error_code, char* error_message);
+/* A Convert message with a CONNECT TLV, serialized once: writing it for
+ * a destination only patches the address and port.
+ */
+struct convert_template
+{
+	uint8_t buff[CONVERT_MSG_MAX_LEN];
+	size_t len;
+	/* offset of the CONNECT TLV in buff */
+	size_t connect_off;
+};
+
+/* Serialize the TLVs of opts, plus a CONNECT TLV whose remote_addr is
+ * left to convert_template_write(). Returns -1 upon failure.
+ */
+int convert_template_init(struct convert_template *tmpl,
+						  const struct convert_opts *opts);
+
+/* Write the message of the template to buff, connecting to addr
+ * (AF_INET or AF_INET6). Returns its length, or -1 with errno set.
+ */
+ssize_t convert_template_write(const struct convert_template *tmpl,
+							   uint8_t *buff, size_t buff_len,
+							   const struct sockaddr *addr);
+
+/* Map the error_code of a Convert error TLV to the errno reported to
+ * the application.
+ */
+int convert_error_to_errno(uint8_t error_code);
+
+/* Reads exactly one Convert message from fd, leaving any data that follows
+ * it in the socket. Returns NULL and sets error_code upon failure.
+ */
+struct convert_opts *read_convert_opts(int fd, int* error_code, char* error_message);
 
 #endif